@@ -20,7 +20,7 @@ static uint32_t palette[12] = {
 #define UART        0x10000000
 #define UART_THR    (uint8_t*)(UART+0x00) // THR:transmitter holding register
 #define UART_LSR    (uint8_t*)(UART+0x05) // LSR:line status register
-#define UART_LSR_EMPTY_MASK 0x40          // LSR Bit 6: Transmitter empty; both the THR and LSR are empty
+#define UART_LSR_THRE_MASK 0x20           // LSR Bit 5: THR empty, room in the transmit FIFO
 
 #define FRAMEBUFFER_VBLANK	0x10038000
 #define FRAMEBUFFER_SWAP	0x10038004
@@ -30,7 +30,7 @@ static uint32_t palette[12] = {
 #define FRAMEBUFFER_Y		224
 
 int lib_putc(char ch) {
-	while ((*UART_LSR & UART_LSR_EMPTY_MASK) == 0);
+	while ((*UART_LSR & UART_LSR_THRE_MASK) == 0);
 	return *UART_THR = ch;
 }
 
@@ -3,7 +3,11 @@
 #define UART        0x10000000
 #define UART_THR    (uint8_t*)(UART+0x00) // THR:transmitter holding register
 #define UART_LSR    (uint8_t*)(UART+0x05) // LSR:line status register
-#define UART_LSR_EMPTY_MASK 0x40          // LSR Bit 6: Transmitter empty; both the THR and LSR are empty
+#define UART_LSR_THRE_MASK 0x20           // LSR Bit 5: THR empty, room in the transmit FIFO
+
+#define IRQ_ENABLE	(uint32_t*)0x11200004
+#define IRQ_VBLANK	1
+#define MIE_MEIE	0x800
 
 #define FRAMEBUFFER_VBLANK	0x10038000
 #define FRAMEBUFFER_SWAP	0x10038004
@@ -12,8 +16,17 @@
 #define FRAMEBUFFER_X		256
 #define FRAMEBUFFER_Y		224
 
+#define BLIT		0x10039000
+#define BLIT_DST	(uint32_t*)(BLIT+0x04)
+#define BLIT_DST_PITCH	(uint32_t*)(BLIT+0x0c)
+#define BLIT_WIDTH	(uint32_t*)(BLIT+0x10)
+#define BLIT_HEIGHT	(uint32_t*)(BLIT+0x14)
+#define BLIT_COLOR	(uint32_t*)(BLIT+0x18)
+#define BLIT_CONTROL	(uint32_t*)(BLIT+0x1c)
+#define BLIT_OP_FILL	1
+
 int lib_putc(char ch) {
-	while ((*UART_LSR & UART_LSR_EMPTY_MASK) == 0);
+	while ((*UART_LSR & UART_LSR_THRE_MASK) == 0);
 	return *UART_THR = ch;
 }
 
@@ -21,25 +34,35 @@ void lib_puts(char *s) {
 	while (*s) lib_putc(*s++);
 }
 
+// Sleep until the next vblank instead of spinning on it.
+void wait_vblank(volatile uint32_t *vblank) {
+	while (!*vblank) {
+		asm volatile("csrs mie, %0\n\twfi" :: "r"(MIE_MEIE));
+	}
+}
+
+// Let the host's blitter clear the screen, not 57344 stores.
+void fill_screen(uint32_t color) {
+	*BLIT_DST = FRAMEBUFFER_BASE;
+	*BLIT_DST_PITCH = FRAMEBUFFER_X * 4;
+	*BLIT_WIDTH = FRAMEBUFFER_X;
+	*BLIT_HEIGHT = FRAMEBUFFER_Y;
+	*BLIT_COLOR = color;
+	*BLIT_CONTROL = BLIT_OP_FILL;
+}
+
 int os_main(void)
 {
 	lib_puts("Black And White framebuffer :D\n");
-	uint32_t *framepointer_mem = (uint32_t *)FRAMEBUFFER_BASE;
 	uint32_t *framepointer_vblank = (uint32_t *)FRAMEBUFFER_VBLANK;	
 	uint32_t *framepointer_swap = (uint32_t *)FRAMEBUFFER_SWAP;
 	uint32_t color = 0x00000000;
-	int y, x;
+	*IRQ_ENABLE = IRQ_VBLANK;
 	while(1) {
-		for(y = 0; y < FRAMEBUFFER_Y; y++){
-			for (x = 0; x < FRAMEBUFFER_X; x++){
-				framepointer_mem[y * FRAMEBUFFER_X + x] = color;
-			}
-		}
+		fill_screen(color);
 		*framepointer_swap = 1;
-		y, x = 0;
 		color += 0x0F0F0F00;
-		while(!*framepointer_vblank){ // wait vblank
-		}
+		wait_vblank(framepointer_vblank);
 		if (color == 0xFFFFFF00)
 			color = 0x00000000;
 	}
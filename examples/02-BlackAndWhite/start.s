@@ -4,12 +4,26 @@ _start:
     # Configura el stack pointer (sp)
     la sp, _stack_top
 
+    # Vector de interrupciones (ver trap_vector)
+    la t0, trap_vector
+    csrw mtvec, t0
+
     # Llama a main (sin argumentos)
     call os_main
 
     # Si main retorna, entra en bucle infinito
 1:  j 1b
 
+    # Solo usamos la interrupcion de vblank para salir de wfi: la
+    # deshabilitamos (mie.MEIE) y os_main la reconoce leyendo vblank.
+    .align 2
+trap_vector:
+    csrw mscratch, t0
+    li t0, 0x800
+    csrc mie, t0
+    csrr t0, mscratch
+    mret
+
     .section .bss
     .align 4
     .space 1024         # 1 KB de pila (ajusta según tus necesidades)
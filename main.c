@@ -3,17 +3,43 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <math.h>
+#if defined( __x86_64__ ) && defined( __GNUC__ )
+#include <immintrin.h>
+#define HOST_SIMD // SSE2 always, AVX2 for scanout if the host has it.
+#endif
 
 // mmio buffer
 uint32_t mmio_size = 0x38008;
 uint8_t *mmio_image = 0;
 
+// MMIO bus.  Devices claim ranges with RegisterMMIO, and every access is
+// routed through mmio_map, which holds a device index per MMIO_GRANULE
+// bytes of the bus.  Index 0 is the unmapped device.
+#define MMIO_BASE 0x10000000
+#define MMIO_END 0x12000000
+#define MMIO_GRANULE_SHIFT 8
+#define MMIO_MAX_DEVICES 16
+typedef uint32_t (*MMIOLoadFn)( uint32_t addy );
+typedef uint32_t (*MMIOStoreFn)( uint32_t addy, uint32_t val ); // Nonzero return ends the CPU slice with that code.
+struct MMIODevice
+{
+	uint32_t base;
+	uint32_t size;
+	MMIOLoadFn load;
+	MMIOStoreFn store;
+};
+struct MMIODevice mmio_devices[MMIO_MAX_DEVICES];
+int mmio_device_count = 1;
+uint8_t mmio_map[( MMIO_END - MMIO_BASE ) >> MMIO_GRANULE_SHIFT];
+
 // SDL2
 #include <SDL2/SDL.h>
 #define FRAMEBUFFER_BASE 0x10000100
+#define FRAMEBUFFER_WINDOW (0x10038000 - FRAMEBUFFER_BASE) // Guest visible part, the display registers sit on top of the rest.
 #define FRAMEBUFFER_X 256
 #define FRAMEBUFFER_Y 224
 #define FRAMEBUFFER_DEPTH 4
@@ -25,16 +51,316 @@ SDL_Window* window;
 SDL_Renderer* renderer;
 SDL_Texture* texture;
 SDL_Event event;
-uint32_t *framebuffer_addr;
-uint32_t *framebuffer_buffer;
+
+// The CPU runs on its own thread.  The main thread owns the window, pumps
+// events and does scanout at 60 Hz, it also raises vblank (0x10038000).
+//
+// The guest draws into framebuffers[framebuffer_back].  A swap (0x10038004)
+// hands that frame to scanout, which copies it straight into the streaming
+// texture at the next vblank.  Swapping again before then replaces it.
+//
+// Back, ready and scanout each own one of the three buffers, so the guest
+// never draws into a buffer scanout is reading.  With one buffer (the
+// default) the guest keeps its buffer, and a swap copies the rows it
+// changed into ready.  With multiple buffering enabled (0x10038008) a swap
+// exchanges back with ready instead, no copying.
+//
+// The core flags every scanline the guest stores to, so vblank only
+// uploads the rows that changed, and doesn't present at all if none did.
+#define FRAMEBUFFER_COUNT 3
+#define FRAMEBUFFER_INDEX 0xff
+#define FRAMEBUFFER_NEW 0x100   // In framebuffer_ready, not picked up by scanout yet.
+#define FRAMEBUFFER_DELTA 0x200 // In framebuffer_ready, its flags only cover what changed since the last frame.
+uint8_t *framebuffers[FRAMEBUFFER_COUNT];
+uint8_t framebuffer_dirty[FRAMEBUFFER_COUNT][FRAMEBUFFER_Y]; // Rows written since that buffer was last uploaded.
+// CPU thread
+uint8_t *framebuffer_addr;    // framebuffers[framebuffer_back], what the guest sees at FRAMEBUFFER_BASE.
+uint8_t *framebuffer_dirty_rows; // framebuffer_dirty[framebuffer_back]
+uint8_t framebuffer_stale[FRAMEBUFFER_COUNT][FRAMEBUFFER_Y]; // Single buffering: rows back changed since they were copied to that buffer.
+int framebuffer_count = 1;
+// Shared
+SDL_atomic_t framebuffer_back;
+SDL_atomic_t framebuffer_ready = { 1 };
+SDL_atomic_t framebuffer_vblank;
+SDL_atomic_t framebuffer_vblank_due; // Render thread, low 32 bits of GetTimeMicroseconds() at the next vblank.
+// Render thread
+int framebuffer_scanout = 2;  // The buffer scanout owns.
+int framebuffer_delta = -1;   // The buffer scanout's flags are relative to, besides itself, or -1.
+int framebuffer_pending = 0;  // Scanout still has to upload the current frame.
+int framebuffer_shown = -1;   // Buffer the texture holds, or -1.
+int framebuffer_redraw = 1;   // Present even if the texture didn't change.
+
+// Pixel format, 0x10038010.  Scanout converts to RGBA8888 for the texture.
+// Pixels are little endian words, RGBA8888 is 0xRRGGBBAA, the 565 modes
+// have red (blue for BGR565) in the top bits.  The indexed mode looks each
+// byte up in the 256 entry RGBA8888 palette at 0x10038400.
+#define FRAMEBUFFER_MODE_RGBA8888 0
+#define FRAMEBUFFER_MODE_RGB565 1
+#define FRAMEBUFFER_MODE_BGR565 2
+#define FRAMEBUFFER_MODE_INDEXED8 3
+#define FRAMEBUFFER_PALETTE 0x10038400
+const int framebuffer_mode_bytes[] = { 4, 2, 2, 1 };
+SDL_atomic_t framebuffer_mode;
+SDL_atomic_t framebuffer_palette_gen; // Bumped on every palette write.
+uint32_t framebuffer_palette[256];
+int framebuffer_shown_mode = -1;      // Render thread, what the texture was converted from.
+int framebuffer_shown_palette = -1;
+
+// Tile and sprite layers, composited over the bitmap at scanout, 0x10038020.
+// All of them are 8x8 tiles of palette indices, index 0 is transparent.
+// The tile sheet (TILE_SHEET_TILES tiles, 64 bytes each), the tile map
+// (TILE_MAP_W by TILE_MAP_H 16 bit entries) and the sprite table
+// (SPRITE_COUNT struct Sprite) are in guest RAM and read every vblank, so
+// changing a tile or moving a sprite is a store or two.  Sprites are drawn
+// over the tiles, or under them with SPRITE_BEHIND, lower numbers on top.
+#define LAYER_TILES 1
+#define LAYER_SPRITES 2
+#define TILE_SHEET_TILES 1024
+#define TILE_MAP_W ( FRAMEBUFFER_X / 8 )
+#define TILE_MAP_H ( FRAMEBUFFER_Y / 8 )
+#define TILE_HFLIP 0x400 // Map entries, bits 0-9 are the tile.
+#define TILE_VFLIP 0x800
+#define SPRITE_COUNT 64
+#define SPRITE_ENABLE 1
+#define SPRITE_HFLIP 2
+#define SPRITE_VFLIP 4
+#define SPRITE_BEHIND 8
+#define SPRITE_SIZE_SHIFT 4 // Flags bits 4-5, 8, 16 or 32 pixels square, tiles in row order.
+struct Sprite
+{
+	int16_t x;
+	int16_t y;
+	uint16_t tile;
+	uint16_t flags;
+};
+SDL_atomic_t layer_enable;        // LAYER_*
+SDL_atomic_t layer_tile_sheet;
+SDL_atomic_t layer_tile_map;
+SDL_atomic_t layer_sprites;
+int framebuffer_shown_untracked = 0; // Render thread, the texture has layers, the surface or text in it.
+
+// Virtual surface, 0x10038030.  Instead of the framebuffer, scanout can show
+// a 256x224 window into a bigger bitmap in guest RAM, in the same pixel
+// format, that wraps around at its edges.  Scrolling is then a write to
+// SCROLL_X/Y, signed, and the line scroll table, if there is one, adds a
+// signed 32 bit X offset per scanline.  Like the layers, it's untracked RAM, so
+// scanout takes the whole window every vblank.
+SDL_atomic_t surface_addr;        // 0 for the framebuffer.
+SDL_atomic_t surface_width;       // Pixels.
+SDL_atomic_t surface_height;
+SDL_atomic_t surface_scroll_x;
+SDL_atomic_t surface_scroll_y;
+SDL_atomic_t surface_line_scroll; // FRAMEBUFFER_Y int32_t, or 0.
+
+// Text mode, 0x10038048.  A TEXT_W by TEXT_H array of 16 bit cells in guest
+// RAM, the character in the low byte and the attribute in the high one,
+// drawn over everything else with the host's 8x8 font.  The attribute is
+// CGA like: foreground in bits 0-3, background in bits 4-6, blink in bit 7,
+// both colors from text_colors.  Background 0 is transparent, so text can
+// sit over a game.  The cursor is an underline at a cell index, TEXT_W *
+// TEXT_H or more hides it.  Blink and the cursor flash every TEXT_BLINK
+// vblanks.
+#define TEXT_W ( FRAMEBUFFER_X / 8 )
+#define TEXT_H ( FRAMEBUFFER_Y / 8 )
+#define TEXT_BLINK 16
+#define TEXT_ATTR_BLINK 0x80
+SDL_atomic_t text_cells;          // 0 for no text.
+SDL_atomic_t text_cursor;
+uint32_t text_frame = 0;          // Render thread, vblanks with text on.
+static const uint32_t text_colors[16] = {
+	0x000000ff, 0x0000aaff, 0x00aa00ff, 0x00aaaaff, 0xaa0000ff, 0xaa00aaff, 0xaa5500ff, 0xaaaaaaff,
+	0x555555ff, 0x5555ffff, 0x55ff55ff, 0x55ffffff, 0xff5555ff, 0xff55ffff, 0xffff55ff, 0xffffffff,
+};
+// ASCII 0x20 to 0x7f, one byte per row, bit 0 is the leftmost pixel.  The
+// public domain font8x8 "basic" set.  Anything else draws as a space.
+static const uint8_t text_font[96][8] = {
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // 20
+	{ 0x18, 0x3c, 0x3c, 0x18, 0x18, 0x00, 0x18, 0x00 }, // 21
+	{ 0x36, 0x36, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // 22
+	{ 0x36, 0x36, 0x7f, 0x36, 0x7f, 0x36, 0x36, 0x00 }, // 23
+	{ 0x0c, 0x3e, 0x03, 0x1e, 0x30, 0x1f, 0x0c, 0x00 }, // 24
+	{ 0x00, 0x63, 0x33, 0x18, 0x0c, 0x66, 0x63, 0x00 }, // 25
+	{ 0x1c, 0x36, 0x1c, 0x6e, 0x3b, 0x33, 0x6e, 0x00 }, // 26
+	{ 0x06, 0x06, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00 }, // 27
+	{ 0x18, 0x0c, 0x06, 0x06, 0x06, 0x0c, 0x18, 0x00 }, // 28
+	{ 0x06, 0x0c, 0x18, 0x18, 0x18, 0x0c, 0x06, 0x00 }, // 29
+	{ 0x00, 0x66, 0x3c, 0xff, 0x3c, 0x66, 0x00, 0x00 }, // 2a
+	{ 0x00, 0x0c, 0x0c, 0x3f, 0x0c, 0x0c, 0x00, 0x00 }, // 2b
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c, 0x06 }, // 2c
+	{ 0x00, 0x00, 0x00, 0x3f, 0x00, 0x00, 0x00, 0x00 }, // 2d
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c, 0x00 }, // 2e
+	{ 0x60, 0x30, 0x18, 0x0c, 0x06, 0x03, 0x01, 0x00 }, // 2f
+	{ 0x3e, 0x63, 0x73, 0x7b, 0x6f, 0x67, 0x3e, 0x00 }, // 30
+	{ 0x0c, 0x0e, 0x0c, 0x0c, 0x0c, 0x0c, 0x3f, 0x00 }, // 31
+	{ 0x1e, 0x33, 0x30, 0x1c, 0x06, 0x33, 0x3f, 0x00 }, // 32
+	{ 0x1e, 0x33, 0x30, 0x1c, 0x30, 0x33, 0x1e, 0x00 }, // 33
+	{ 0x38, 0x3c, 0x36, 0x33, 0x7f, 0x30, 0x78, 0x00 }, // 34
+	{ 0x3f, 0x03, 0x1f, 0x30, 0x30, 0x33, 0x1e, 0x00 }, // 35
+	{ 0x1c, 0x06, 0x03, 0x1f, 0x33, 0x33, 0x1e, 0x00 }, // 36
+	{ 0x3f, 0x33, 0x30, 0x18, 0x0c, 0x0c, 0x0c, 0x00 }, // 37
+	{ 0x1e, 0x33, 0x33, 0x1e, 0x33, 0x33, 0x1e, 0x00 }, // 38
+	{ 0x1e, 0x33, 0x33, 0x3e, 0x30, 0x18, 0x0e, 0x00 }, // 39
+	{ 0x00, 0x0c, 0x0c, 0x00, 0x00, 0x0c, 0x0c, 0x00 }, // 3a
+	{ 0x00, 0x0c, 0x0c, 0x00, 0x00, 0x0c, 0x0c, 0x06 }, // 3b
+	{ 0x18, 0x0c, 0x06, 0x03, 0x06, 0x0c, 0x18, 0x00 }, // 3c
+	{ 0x00, 0x00, 0x3f, 0x00, 0x00, 0x3f, 0x00, 0x00 }, // 3d
+	{ 0x06, 0x0c, 0x18, 0x30, 0x18, 0x0c, 0x06, 0x00 }, // 3e
+	{ 0x1e, 0x33, 0x30, 0x18, 0x0c, 0x00, 0x0c, 0x00 }, // 3f
+	{ 0x3e, 0x63, 0x7b, 0x7b, 0x7b, 0x03, 0x1e, 0x00 }, // 40
+	{ 0x0c, 0x1e, 0x33, 0x33, 0x3f, 0x33, 0x33, 0x00 }, // 41
+	{ 0x3f, 0x66, 0x66, 0x3e, 0x66, 0x66, 0x3f, 0x00 }, // 42
+	{ 0x3c, 0x66, 0x03, 0x03, 0x03, 0x66, 0x3c, 0x00 }, // 43
+	{ 0x1f, 0x36, 0x66, 0x66, 0x66, 0x36, 0x1f, 0x00 }, // 44
+	{ 0x7f, 0x46, 0x16, 0x1e, 0x16, 0x46, 0x7f, 0x00 }, // 45
+	{ 0x7f, 0x46, 0x16, 0x1e, 0x16, 0x06, 0x0f, 0x00 }, // 46
+	{ 0x3c, 0x66, 0x03, 0x03, 0x73, 0x66, 0x7c, 0x00 }, // 47
+	{ 0x33, 0x33, 0x33, 0x3f, 0x33, 0x33, 0x33, 0x00 }, // 48
+	{ 0x1e, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x1e, 0x00 }, // 49
+	{ 0x78, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1e, 0x00 }, // 4a
+	{ 0x67, 0x66, 0x36, 0x1e, 0x36, 0x66, 0x67, 0x00 }, // 4b
+	{ 0x0f, 0x06, 0x06, 0x06, 0x46, 0x66, 0x7f, 0x00 }, // 4c
+	{ 0x63, 0x77, 0x7f, 0x7f, 0x6b, 0x63, 0x63, 0x00 }, // 4d
+	{ 0x63, 0x67, 0x6f, 0x7b, 0x73, 0x63, 0x63, 0x00 }, // 4e
+	{ 0x1c, 0x36, 0x63, 0x63, 0x63, 0x36, 0x1c, 0x00 }, // 4f
+	{ 0x3f, 0x66, 0x66, 0x3e, 0x06, 0x06, 0x0f, 0x00 }, // 50
+	{ 0x1e, 0x33, 0x33, 0x33, 0x3b, 0x1e, 0x38, 0x00 }, // 51
+	{ 0x3f, 0x66, 0x66, 0x3e, 0x36, 0x66, 0x67, 0x00 }, // 52
+	{ 0x1e, 0x33, 0x07, 0x0e, 0x38, 0x33, 0x1e, 0x00 }, // 53
+	{ 0x3f, 0x2d, 0x0c, 0x0c, 0x0c, 0x0c, 0x1e, 0x00 }, // 54
+	{ 0x33, 0x33, 0x33, 0x33, 0x33, 0x33, 0x3f, 0x00 }, // 55
+	{ 0x33, 0x33, 0x33, 0x33, 0x33, 0x1e, 0x0c, 0x00 }, // 56
+	{ 0x63, 0x63, 0x63, 0x6b, 0x7f, 0x77, 0x63, 0x00 }, // 57
+	{ 0x63, 0x63, 0x36, 0x1c, 0x1c, 0x36, 0x63, 0x00 }, // 58
+	{ 0x33, 0x33, 0x33, 0x1e, 0x0c, 0x0c, 0x1e, 0x00 }, // 59
+	{ 0x7f, 0x63, 0x31, 0x18, 0x4c, 0x66, 0x7f, 0x00 }, // 5a
+	{ 0x1e, 0x06, 0x06, 0x06, 0x06, 0x06, 0x1e, 0x00 }, // 5b
+	{ 0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0x40, 0x00 }, // 5c
+	{ 0x1e, 0x18, 0x18, 0x18, 0x18, 0x18, 0x1e, 0x00 }, // 5d
+	{ 0x08, 0x1c, 0x36, 0x63, 0x00, 0x00, 0x00, 0x00 }, // 5e
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff }, // 5f
+	{ 0x0c, 0x0c, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00 }, // 60
+	{ 0x00, 0x00, 0x1e, 0x30, 0x3e, 0x33, 0x6e, 0x00 }, // 61
+	{ 0x07, 0x06, 0x06, 0x3e, 0x66, 0x66, 0x3b, 0x00 }, // 62
+	{ 0x00, 0x00, 0x1e, 0x33, 0x03, 0x33, 0x1e, 0x00 }, // 63
+	{ 0x38, 0x30, 0x30, 0x3e, 0x33, 0x33, 0x6e, 0x00 }, // 64
+	{ 0x00, 0x00, 0x1e, 0x33, 0x3f, 0x03, 0x1e, 0x00 }, // 65
+	{ 0x1c, 0x36, 0x06, 0x0f, 0x06, 0x06, 0x0f, 0x00 }, // 66
+	{ 0x00, 0x00, 0x6e, 0x33, 0x33, 0x3e, 0x30, 0x1f }, // 67
+	{ 0x07, 0x06, 0x36, 0x6e, 0x66, 0x66, 0x67, 0x00 }, // 68
+	{ 0x0c, 0x00, 0x0e, 0x0c, 0x0c, 0x0c, 0x1e, 0x00 }, // 69
+	{ 0x30, 0x00, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1e }, // 6a
+	{ 0x07, 0x06, 0x66, 0x36, 0x1e, 0x36, 0x67, 0x00 }, // 6b
+	{ 0x0e, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x1e, 0x00 }, // 6c
+	{ 0x00, 0x00, 0x33, 0x7f, 0x7f, 0x6b, 0x63, 0x00 }, // 6d
+	{ 0x00, 0x00, 0x1f, 0x33, 0x33, 0x33, 0x33, 0x00 }, // 6e
+	{ 0x00, 0x00, 0x1e, 0x33, 0x33, 0x33, 0x1e, 0x00 }, // 6f
+	{ 0x00, 0x00, 0x3b, 0x66, 0x66, 0x3e, 0x06, 0x0f }, // 70
+	{ 0x00, 0x00, 0x6e, 0x33, 0x33, 0x3e, 0x30, 0x78 }, // 71
+	{ 0x00, 0x00, 0x3b, 0x6e, 0x66, 0x06, 0x0f, 0x00 }, // 72
+	{ 0x00, 0x00, 0x3e, 0x03, 0x1e, 0x30, 0x1f, 0x00 }, // 73
+	{ 0x08, 0x0c, 0x3e, 0x0c, 0x0c, 0x2c, 0x18, 0x00 }, // 74
+	{ 0x00, 0x00, 0x33, 0x33, 0x33, 0x33, 0x6e, 0x00 }, // 75
+	{ 0x00, 0x00, 0x33, 0x33, 0x33, 0x1e, 0x0c, 0x00 }, // 76
+	{ 0x00, 0x00, 0x63, 0x6b, 0x7f, 0x7f, 0x36, 0x00 }, // 77
+	{ 0x00, 0x00, 0x63, 0x36, 0x1c, 0x36, 0x63, 0x00 }, // 78
+	{ 0x00, 0x00, 0x33, 0x33, 0x33, 0x3e, 0x30, 0x1f }, // 79
+	{ 0x00, 0x00, 0x3f, 0x19, 0x0c, 0x26, 0x3f, 0x00 }, // 7a
+	{ 0x38, 0x0c, 0x0c, 0x07, 0x0c, 0x0c, 0x38, 0x00 }, // 7b
+	{ 0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x18, 0x00 }, // 7c
+	{ 0x07, 0x0c, 0x0c, 0x38, 0x0c, 0x0c, 0x07, 0x00 }, // 7d
+	{ 0x6e, 0x3b, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // 7e
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // 7f
+};
+
+// Headless, -H: no window, the cpu thread does scanout itself into
+// scanout_image every FRAMEBUFFER_HZ-th of a second of guest time, and
+// can hash (-x) or dump (-o, -r) the frames it got.
+int headless = 0;
+uint8_t * scanout_image;
+uint32_t frame_number;
+FILE * frame_hash_file;
+const char * frame_dump_pattern = 0; // printf pattern for the frame number, .ppm or raw RGBA.
+long frame_dump_first = 0;
+long frame_dump_last = -1;
+
+// UART transmit FIFO.  The cpu thread puts bytes in, the uart thread
+// writes them out in batches: on a newline, once it's half full, when the
+// guest goes idle, and otherwise every UART_TX_IDLE_MS.  A guest that keeps
+// polling the line status is waiting on the FIFO, so the cpu thread writes
+// it out itself then.  Head and tail only ever count up.
+#define UART_TX_SIZE 4096 // Power of 2.
+#define UART_TX_IDLE_MS 10
+#define UART_LSR_DR 0x01   // Data ready.
+#define UART_LSR_THRE 0x20 // Room in the FIFO.
+#define UART_LSR_TEMT 0x40 // FIFO empty, all of it written out.
+uint8_t uart_tx[UART_TX_SIZE];
+SDL_atomic_t uart_tx_head;
+SDL_atomic_t uart_tx_tail;
+SDL_atomic_t uart_tx_wake; // Set once the uart thread has been woken, until it looks.
+SDL_atomic_t uart_tx_quit;
+SDL_mutex * uart_tx_lock; // Held while writing out, which can block on a slow stdout.
+int uart_lsr_polls;        // Cpu thread, line status reads since the last byte.
+SDL_sem * uart_tx_sem;
+SDL_Thread * uart_thread;
+
+// UART receive FIFO.  The input thread blocks on stdin and puts what it
+// gets in here, so the line status and CSR 0x140 only look at memory.
+#define UART_RX_SIZE 256 // Power of 2.
+uint8_t uart_rx[UART_RX_SIZE];
+SDL_atomic_t uart_rx_head;
+SDL_atomic_t uart_rx_tail;
+
+// Interrupt controller at 0x11200000.  Each source has a bit, and the hart
+// sees a machine external interrupt (MEIP) while any enabled one is
+// pending.  Sources are acknowledged at the device, reading vblank clears
+// IRQ_VBLANK, reading the blitter status clears IRQ_BLIT, IRQ_UART is
+// pending until the receive FIFO has been read empty.
+#define IRQ_VBLANK 1
+#define IRQ_BLIT 2
+#define IRQ_UART 4
+uint32_t irq_enable;
+
+// Blitter at 0x10039000.  Set up the registers, then write an op to
+// BLIT_CONTROL.  It runs right away, and sets BLIT_STATUS_DONE and IRQ_BLIT
+// when it's finished.  Addresses are guest physical, in RAM or the back
+// buffer, pitches are in bytes and the width is in pixels.
+#define BLIT_BASE 0x10039000
+#define BLIT_SRC 0x00
+#define BLIT_DST 0x04
+#define BLIT_SRC_PITCH 0x08
+#define BLIT_DST_PITCH 0x0c
+#define BLIT_WIDTH 0x10
+#define BLIT_HEIGHT 0x14
+#define BLIT_COLOR 0x18      // Fill color, or the color key.
+#define BLIT_CONTROL 0x1c
+#define BLIT_STATUS 0x20
+#define BLIT_OP_FILL 1
+#define BLIT_OP_COPY 2
+#define BLIT_OP_COPY_KEYED 3 // Leaves pixels alone where the source is BLIT_COLOR.
+#define BLIT_OP_BLEND 4      // RGBA8888 only, source alpha over the destination.
+#define BLIT_BPP_SHIFT 8     // BLIT_CONTROL bits 8-9, 0: 32, 1: 16, 2: 8 bits per pixel.
+#define BLIT_STATUS_DONE 1
+#define BLIT_STATUS_ERROR 2  // Bad op, or a rectangle outside RAM and the framebuffer.
+uint32_t blit_regs[BLIT_STATUS >> 2];
+uint32_t blit_status;
 
 // The virtual console has 8MB of ram.
 uint32_t ram_amt = 8*1024*1024;
 int fail_on_all_faults = 0;
 
-// cpu speed
-#define LIMITED_CPU 0
-#define TARGET_HZ 50000000;
+// cpu speed, -s.  Paced against an absolute schedule, instructions since
+// pace_start at cpu_hz, so sleeps can be coarse and time lost to a slow
+// slice is made up.  Running behind by more than PACE_BEHIND_MAX_US starts
+// a new schedule instead of racing to catch up.
+double cpu_hz = 0; // 0 for as fast as it goes.
+#define PACE_SLEEP_US 1000
+#define PACE_BEHIND_MAX_US 100000
+
+// cpu engine, selectable with -e
+#define ENGINE_REFERENCE 0
+#define ENGINE_DECODE_CACHE 1
+#define ENGINE_JIT 2
+int cpu_engine = ENGINE_REFERENCE;
 
 static uint64_t GetTimeMicroseconds();
 static void ResetKeyboardInput();
@@ -42,11 +368,33 @@ static void CaptureKeyboardInput();
 static uint32_t HandleException( uint32_t ir, uint32_t retval );
 static uint32_t HandleControlStore( uint32_t addy, uint32_t val );
 static uint32_t HandleControlLoad( uint32_t addy );
+static int RegisterMMIO( uint32_t base, uint32_t size, MMIOLoadFn load, MMIOStoreFn store );
+static int RegisterDevices();
+static void SetBackBuffer( int b );
+static void CopyBackBuffer();
+static void ResetDisplay();
+static int UploadFramebuffer();
 static void HandleOtherCSRWrite( uint8_t * image, uint16_t csrno, uint32_t value );
 static int32_t HandleOtherCSRRead( uint8_t * image, uint16_t csrno );
-static void MiniSleep();
-static int IsKBHit();
+static void IdleInit();
+static void IdleWait( uint64_t us );
+static void IdleWake();
 static int ReadKBByte();
+static int ParseEngine( const char * name );
+static int CheckFramePattern( const char * pattern );
+static uint32_t PendingInterrupts();
+static void CaptureFrame();
+static int32_t StepCore( uint32_t elapsedUs, int count );
+static uint64_t HashImage( const uint8_t * image, uint32_t len );
+static int SaveSnapshot();
+static int RestoreSnapshot();
+static void * AllocPages( uint64_t len );
+static void ZeroPages( void * addr, uint64_t len );
+static uint8_t * MapFile( const char * path, uint64_t len );
+static void UnmapFile( uint8_t * map, uint64_t len );
+static void SyncFile( uint8_t * map, uint64_t len );
+static void LoadTranslationCache();
+static void SaveTranslationCache();
 
 // This is the functionality we want to override in the emulator.
 //  think of this as the way the emulator's processor is connected to the outside world.
@@ -54,29 +402,107 @@ static int ReadKBByte();
 #define MINIRV32_DECORATE  static
 #define MINI_RV32_RAM_SIZE ram_amt
 #define MINIRV32_IMPLEMENTATION
+#define MINIRV32_DECODE_CACHE
 #define MINIRV32_POSTEXEC( pc, ir, retval ) { if( retval > 0 ) { if( fail_on_all_faults ) { printf( "FAULT\n" ); return 3; } else retval = HandleException( ir, retval ); } }
+#define MINIRV32_HOSTMEM_BASE FRAMEBUFFER_BASE
+#define MINIRV32_HOSTMEM_SIZE FRAMEBUFFER_WINDOW
+#define MINIRV32_HOSTMEM_PTR framebuffer_addr
+#define MINIRV32_HOSTMEM_DIRTY framebuffer_dirty_rows
+#define MINIRV32_HOSTMEM_DIRTY_SHIFT 10 // One flag per scanline, FRAMEBUFFER_X * FRAMEBUFFER_DEPTH bytes.
+#define MINIRV32_EXTERNAL_INTERRUPT ( irq_enable && ( PendingInterrupts() & irq_enable ) )
+#define MINIRV32_MMIO_RANGE( n ) ( (uint32_t)( (n) - MMIO_BASE ) < MMIO_END - MMIO_BASE )
 #define MINIRV32_HANDLE_MEM_STORE_CONTROL( addy, val ) if( HandleControlStore( addy, val ) ) return val;
 #define MINIRV32_HANDLE_MEM_LOAD_CONTROL( addy, rval ) rval = HandleControlLoad( addy );
 #define MINIRV32_OTHERCSR_WRITE( csrno, value ) HandleOtherCSRWrite( image, csrno, value );
 #define MINIRV32_OTHERCSR_READ( csrno, value ) value = HandleOtherCSRRead( image, csrno );
 
 #include "mini-rv32ima.h"
+#include "mini-rv32ima-jit.h"
 
 uint8_t * ram_image = 0;
 struct MiniRV32IMAState * core;
+struct MiniRV32IMADecodeCache * dcache;
+#ifdef MINIRV32_JIT_AVAILABLE
+#define ENGINE_NAMES "interp, cache, jit"
+struct MiniRV32IMAJit * jit;
+#else
+#define ENGINE_NAMES "interp, cache"
+#endif
 const char * kernel_command_line = 0;
 
+// translation cache, enabled with -t
+const char * tcache_dir = 0;
+uint64_t image_hash;
+
+// ELF images are loaded by segment instead of as a flat binary, and keep
+// their symbol table for naming guest addresses, see SymbolAt().  Only the
+// fields the loader reads, riscv32 little endian.
+#define ELF_PT_LOAD 1
+#define ELF_SHT_SYMTAB 2
+#define ELF_EM_RISCV 243
+struct ElfHeader
+{
+	uint8_t ident[16];
+	uint16_t type, machine;
+	uint32_t version, entry, phoff, shoff, flags;
+	uint16_t ehsize, phentsize, phnum, shentsize, shnum, shstrndx;
+};
+struct ElfProgramHeader { uint32_t type, offset, vaddr, paddr, filesz, memsz, flags, align; };
+struct ElfSectionHeader { uint32_t name, type, flags, addr, offset, size, link, info, addralign, entsize; };
+struct ElfSymbol { uint32_t name, value, size; uint8_t info, other; uint16_t shndx; };
+struct ElfSymbol * symbols = 0; // Sorted by value.
+uint32_t symbol_count = 0;
+char * symbol_names = 0;
+
+// Snapshots, -S.  One file, mapped to save it: a header page with the
+// device registers, the MMIO image, the framebuffers, then RAM with the
+// core at its end, each page aligned.  Saving again into the same file only
+// writes the pages that differ from it, and restoring only copies the RAM
+// pages that aren't all zero.
+// A snapshot is taken at the end of a slice, after the guest writes
+// SYSCON_SNAPSHOT to syscon or F5 in the window.
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_PAGE 4096
+#define SYSCON_SNAPSHOT 0x5353
+const char * snapshot_file = 0;
+SDL_atomic_t snapshot_request;
+
+// cpu thread.  The core only looks at interrupts between calls, so each
+// call runs up to the next thing the guest might be waiting for, its timer
+// or a vblank, and no more than SLICE_MAX_US of guest time, so that input
+// doesn't wait on a long computation.
+#define SLICE_MIN 64
+#define SLICE_MAX_US 1000
+const char * bios_file_name = 0;
+long long instct = -1;
+int time_divisor = 1;
+int fixed_update = 0;
+int64_t time_base = 0; // With -l, the timer is the instruction count over time_divisor plus this.
+int do_sleep = 1;
+SDL_atomic_t cpu_quit;
+SDL_atomic_t cpu_done;
+SDL_atomic_t cpu_idle; // In wfi, WakeCPU() for anything that might end it.
+#define IDLE_MAX_US 1000000
+
 static void DumpState( struct MiniRV32IMAState * core, uint8_t * ram_image );
+static int LoadImage();
+static const char * SymbolAt( uint32_t addr, uint32_t * ofs );
+static int CPUThread( void * unused );
+static int SliceBudget( uint64_t guest_time, uint64_t next_vblank, double instrs_per_us );
+static void WaitForEvent( uint64_t us );
+static void WakeCPU();
+static int UartThread( void * unused );
+static void UartPut( const void * data, uint32_t len );
+static void UartKick();
+static void UartDrain();
+static int InputThread( void * unused );
+static int UartRxReady();
+static int UartGet();
 
 int main( int argc, char ** argv )
 {
 	int i;
-	long long instct = -1;
 	int show_help = 0;
-	int time_divisor = 1;
-	int fixed_update = 0;
-	int do_sleep = 1;
-	const char * bios_file_name = 0;
 	for( i = 1; i < argc; i++ )
 	{
 		const char * param = argv[i];
@@ -88,6 +514,33 @@ int main( int argc, char ** argv )
 				switch( param[1] )
 				{
 				case 'b': bios_file_name = (++i<argc)?argv[i]:0; break;
+				case 'c': instct = (++i<argc)?strtoll( argv[i], 0, 0 ):-1; break;
+				case 't': tcache_dir = (++i<argc)?argv[i]:0; break;
+				case 'e': cpu_engine = (++i<argc)?ParseEngine( argv[i] ):-1; if( cpu_engine < 0 ) show_help = 1; break;
+				case 'l': param_continue = 1; fixed_update = 1; break;
+				case 'p': param_continue = 1; do_sleep = 0; break;
+				case 's':
+				{
+					char * unit = 0;
+					cpu_hz = (++i<argc)?strtod( argv[i], &unit ):-1;
+					if( unit && ( *unit == 'k' || *unit == 'K' ) ) cpu_hz *= 1e3;
+					else if( unit && ( *unit == 'm' || *unit == 'M' ) ) cpu_hz *= 1e6;
+					else if( unit && ( *unit == 'g' || *unit == 'G' ) ) cpu_hz *= 1e9;
+					if( cpu_hz < 0 ) show_help = 1;
+					break;
+				}
+				case 'S': snapshot_file = (++i<argc)?argv[i]:0; break;
+				case 'T': time_divisor = (++i<argc)?atoi( argv[i] ):0; if( time_divisor < 1 ) show_help = 1; break;
+				case 'H': headless = 1; break;
+				case 'x': frame_hash_file = (++i<argc)?( strcmp( argv[i], "-" ) ? fopen( argv[i], "w" ) : stdout ):0; if( !frame_hash_file ) show_help = 1; break;
+				case 'o': frame_dump_pattern = (++i<argc)?argv[i]:0; if( !frame_dump_pattern || !CheckFramePattern( frame_dump_pattern ) ) show_help = 1; break;
+				case 'r':
+				{
+					char * last = 0;
+					frame_dump_first = (++i<argc)?strtol( argv[i], &last, 0 ):0;
+					frame_dump_last = ( last && *last == '-' ) ? ( last[1] ? strtol( last + 1, 0, 0 ) : -1 ) : frame_dump_first;
+					break;
+				}
 				default:
 					if( param_continue )
 						param_continue = 0;
@@ -106,14 +559,17 @@ int main( int argc, char ** argv )
 	}
 	if( show_help || bios_file_name == 0 )
 	{
-		fprintf( stderr, "virtualconsole: [parameters]\n\t-b [bios image]\n" );
+		fprintf( stderr, "virtualconsole: [parameters]\n\t-b [bios image, flat binary or ELF]\n\t-c [instruction count]\n\t-e [cpu engine: " ENGINE_NAMES "]\n\t-t [translation cache directory]\n\t-l lock guest time to the instruction count\n\t-p don't sleep on wfi\n\t-T [time divisor, instructions per guest microsecond with -l]\n\t-s [cpu speed in Hz, k/M/G suffix, 0 for unlimited]\n\t-S [snapshot file, resumed from if it exists]\n\t-H headless, guest time follows the instruction count\n\t-x [frame hash file, - for stdout] (headless)\n\t-o [frame dump file pattern with one %%d, .ppm or raw RGBA] (headless)\n\t-r [first frame to dump[-last]]\n" );
 		return 1;
 	}
 
-	ram_image = malloc( ram_amt );
+	ram_image = AllocPages( ram_amt ); // Page aligned, so a snapshot can be mapped over it.
 	mmio_image = malloc( mmio_size );
-	framebuffer_buffer = (uint32_t *) malloc(FRAMEBUFFER_X * FRAMEBUFFER_Y * sizeof(uint32_t));
-	framebuffer_addr = (uint32_t *)(mmio_image + 0x100);
+	for( i = 0; i < FRAMEBUFFER_COUNT; i++ )
+		framebuffers[i] = calloc( FRAMEBUFFER_SIZE8, 1 );
+	dcache = malloc( sizeof( struct MiniRV32IMADecodeCache ) );
+	if( dcache ) dcache->code_pages = malloc( ram_amt >> MINIRV32_CODE_PAGE_SHIFT );
+	if( dcache ) dcache->code_words = malloc( ram_amt >> 5 );
 	if( !ram_image )
 	{
 		fprintf( stderr, "Error: could not allocate system image.\n" );
@@ -124,34 +580,61 @@ int main( int argc, char ** argv )
 		fprintf( stderr, "Error: could not allocate mmio image.\n" );
 		return -4;
 	}
-	if (framebuffer_buffer == NULL) {
+	if (framebuffers[0] == NULL || framebuffers[1] == NULL || framebuffers[2] == NULL) {
 		fprintf(stderr, "Can't reserve framebuffer mem.\n");
 		return 1;
 	}
-restart:
+	if( headless && !( scanout_image = calloc( FRAMEBUFFER_SIZE8, 1 ) ) )
 	{
-		FILE * f = fopen( bios_file_name, "rb" );
-		if( !f || ferror( f ) )
-		{
-			fprintf( stderr, "Error: \"%s\" not found\n", bios_file_name );
-			return -5;
-		}
-		fseek( f, 0, SEEK_END );
-		long flen = ftell( f );
-		fseek( f, 0, SEEK_SET );
-		if( flen > ram_amt )
-		{
-			fprintf( stderr, "Error: Could not fit RAM image (%ld bytes) into %d\n", flen, ram_amt );
-			return -6;
-		}
+		fprintf( stderr, "Error: could not allocate scanout image.\n" );
+		return -4;
+	}
+	if( !dcache || !dcache->code_pages || !dcache->code_words )
+	{
+		fprintf( stderr, "Error: could not allocate decode cache.\n" );
+		return -4;
+	}
+	if( RegisterDevices() )
+	{
+		fprintf( stderr, "Error: could not map devices.\n" );
+		return -4;
+	}
+	CaptureKeyboardInput();
+	IdleInit();
+	SDL_Thread * input_thread = SDL_CreateThread( InputThread, "input", 0 );
+	if( !input_thread || !( uart_tx_sem = SDL_CreateSemaphore( 0 ) ) || !( uart_tx_lock = SDL_CreateMutex() ) || !( uart_thread = SDL_CreateThread( UartThread, "uart", 0 ) ) )
+	{
+		fprintf( stderr, "Error: could not start uart threads: %s\n", SDL_GetError() );
+		return -4;
+	}
+	SDL_DetachThread( input_thread ); // Stuck in a read until exit.
+#ifdef MINIRV32_JIT_AVAILABLE
+	if( cpu_engine == ENGINE_JIT && !( jit = MiniRV32IMAJitCreate( dcache ) ) )
+	{
+		fprintf( stderr, "Error: could not allocate jit code buffer.\n" );
+		return -4;
+	}
+#endif
+	if( headless )
+	{
+		// Deterministic, and no reason to wait on a wall clock.  Set
+		// before a snapshot is restored, it picks its time base by -l.
+		fixed_update = 1;
+		do_sleep = 0;
+	}
+	SetBackBuffer( 0 );
+	int ret = LoadImage();
+	if( !ret && snapshot_file ) ret = RestoreSnapshot();
+	if( ret ) return ret;
 
-		memset( ram_image, 0, ram_amt );
-		if( fread( ram_image, flen, 1, f ) != 1)
-		{
-			fprintf( stderr, "Error: Could not load image.\n" );
-			return -7;
-		}
-		fclose( f );
+	if( headless )
+	{
+		ret = CPUThread( 0 );
+		SDL_AtomicSet( &uart_tx_quit, 1 );
+		SDL_SemPost( uart_tx_sem );
+		SDL_WaitThread( uart_thread, 0 );
+		if( frame_hash_file ) fclose( frame_hash_file );
+		return ret;
 	}
 
 	window = SDL_CreateWindow("VM Framebuffer",
@@ -176,7 +659,7 @@ restart:
 
 	texture = SDL_CreateTexture(renderer,
 				    SDL_PIXELFORMAT_RGBA8888,
-				    SDL_TEXTUREACCESS_STATIC,
+				    SDL_TEXTUREACCESS_STREAMING,
 				    FRAMEBUFFER_X,
 				    FRAMEBUFFER_Y);
 	if (texture == NULL) {
@@ -187,84 +670,405 @@ restart:
 		return 1;
 	}
 
-	SDL_Delay(2000);
-
-	CaptureKeyboardInput();
-
-	// The core lives at the end of RAM.
-	core = (struct MiniRV32IMAState *)(ram_image + ram_amt - sizeof( struct MiniRV32IMAState ));
-	core->pc = MINIRV32_RAM_IMAGE_OFFSET;
-	core->regs[10] = 0x00; //hart ID
-	core->extraflags |= 3; // Machine-mode.
-	// Image is loaded.
+	SDL_Thread * cpu_thread = SDL_CreateThread( CPUThread, "cpu", 0 );
+	if (cpu_thread == NULL) {
+		fprintf(stderr, "Can't start cpu thread: %s\n", SDL_GetError());
+		SDL_DestroyTexture(texture);
+		SDL_DestroyRenderer(renderer);
+		SDL_DestroyWindow(window);
+		SDL_Quit();
+		return 1;
+	}
 
-	// framebuffer
+	// Event pump and scanout, until the cpu thread stops.
 	uint64_t last_screen_update = 0;
-
-	uint64_t rt;
-	uint64_t lastTime = (fixed_update)?0:(GetTimeMicroseconds()/time_divisor);
-	int instrs_per_flip = 1024;
-	for( rt = 0; rt < instct+1 || instct < 0; rt += instrs_per_flip )
+	while( !SDL_AtomicGet( &cpu_done ) )
 	{
 		while (SDL_PollEvent(&event)){
-			if (event.type == SDL_QUIT) {
-				SDL_DestroyTexture(texture);
-				SDL_DestroyRenderer(renderer);
-				SDL_DestroyWindow(window);
-				SDL_Quit();
-				return 0;
+			if (event.type == SDL_QUIT)
+			{
+				SDL_AtomicSet( &cpu_quit, 1 );
+				WakeCPU();
 			}
+			else if (event.type == SDL_WINDOWEVENT)
+				framebuffer_redraw = 1;
+			else if( event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_F5 && snapshot_file )
+				SDL_AtomicSet( &snapshot_request, 1 );
 		}
 
-		uint64_t tick_start = GetTimeMicroseconds();
-
 		// framebuffer updates 60 hz per second
 		uint64_t now = GetTimeMicroseconds();
 		if (now - last_screen_update >= framebuffer_interval) {
-		    //uint32_t *framebuffer_pointer = (uint32_t *)(mmio_image + 0x100);
-		    SDL_UpdateTexture(texture, NULL, framebuffer_buffer, FRAMEBUFFER_X * FRAMEBUFFER_DEPTH);
-		    SDL_SetRenderDrawColor(renderer, 0x00, 0x00, 0x00, 0xFF);
-		    SDL_RenderClear(renderer);
-		    SDL_Rect destRect = { (640 - FRAMEBUFFER_X) / 2, (480 - FRAMEBUFFER_Y) / 2, FRAMEBUFFER_X, FRAMEBUFFER_Y };
-		    SDL_RenderCopy(renderer, texture, NULL, &destRect);
-		    SDL_RenderPresent(renderer);
-		    *((uint32_t*)(mmio_image + (0x10038000 - 0x10000000))) = 1;
+		    if (UploadFramebuffer() || framebuffer_redraw) {
+			SDL_SetRenderDrawColor(renderer, 0x00, 0x00, 0x00, 0xFF);
+			SDL_RenderClear(renderer);
+			SDL_Rect destRect = { (640 - FRAMEBUFFER_X) / 2, (480 - FRAMEBUFFER_Y) / 2, FRAMEBUFFER_X, FRAMEBUFFER_Y };
+			SDL_RenderCopy(renderer, texture, NULL, &destRect);
+			SDL_RenderPresent(renderer);
+			framebuffer_redraw = 0;
+		    }
+		    SDL_AtomicSet( &framebuffer_vblank, 1 );
+		    WakeCPU();
 		    last_screen_update = now;
+		    now = GetTimeMicroseconds();
+		}
+		uint64_t next = last_screen_update + framebuffer_interval;
+		SDL_AtomicSet( &framebuffer_vblank_due, (uint32_t)next );
+		if( next > now )
+			SDL_WaitEventTimeout( NULL, ( next - now + 999 ) / 1000 );
+	}
+
+	SDL_WaitThread( cpu_thread, &ret );
+	SDL_AtomicSet( &uart_tx_quit, 1 );
+	SDL_SemPost( uart_tx_sem );
+	SDL_WaitThread( uart_thread, 0 );
+	SDL_DestroyTexture(texture);
+	SDL_DestroyRenderer(renderer);
+	SDL_DestroyWindow(window);
+	SDL_Quit();
+	return ret;
+}
+
+static int ReadAt( FILE * f, uint32_t ofs, uint8_t * dst, uint32_t len )
+{
+	return ( len && ( fseek( f, ofs, SEEK_SET ) || fread( dst, len, 1, f ) != 1 ) ) ? -1 : 0;
+}
+
+static void FreeSymbols()
+{
+	free( symbols );
+	free( symbol_names );
+	symbols = 0;
+	symbol_names = 0;
+	symbol_count = 0;
+}
+
+static int CompareSymbols( const void * a, const void * b )
+{
+	uint32_t va = ((const struct ElfSymbol *)a)->value, vb = ((const struct ElfSymbol *)b)->value;
+	return ( va > vb ) - ( va < vb );
+}
+
+// Without one the image still runs, there's just nothing to name addresses.
+static void LoadSymbols( FILE * f, const struct ElfHeader * eh )
+{
+	struct ElfSectionHeader sh, strtab;
+	uint32_t i, n;
+	if( eh->shentsize != sizeof( sh ) ) return;
+	for( i = 0; i < eh->shnum; i++ )
+	{
+		if( ReadAt( f, eh->shoff + i * sizeof( sh ), (uint8_t*)&sh, sizeof( sh ) ) ) return;
+		if( sh.type == ELF_SHT_SYMTAB ) break;
+	}
+	if( i == eh->shnum || sh.link >= eh->shnum ||
+		ReadAt( f, eh->shoff + sh.link * sizeof( strtab ), (uint8_t*)&strtab, sizeof( strtab ) ) )
+		return;
+	symbols = malloc( sh.size );
+	symbol_names = malloc( strtab.size + 1 );
+	if( !symbols || !symbol_names || ReadAt( f, sh.offset, (uint8_t*)symbols, sh.size ) ||
+		ReadAt( f, strtab.offset, (uint8_t*)symbol_names, strtab.size ) )
+	{
+		FreeSymbols();
+		return;
+	}
+	symbol_names[strtab.size] = 0;
+
+	// Keep named code and data labels, not sections, files, or absolute
+	// and common symbols.
+	for( i = 0, n = sh.size / sizeof( struct ElfSymbol ); i < n; i++ )
+	{
+		struct ElfSymbol * s = &symbols[i];
+		if( s->shndx && s->shndx < 0xff00 && ( s->info & 0xf ) <= 2 && s->name && s->name < strtab.size )
+			symbols[symbol_count++] = *s;
+	}
+	qsort( symbols, symbol_count, sizeof( struct ElfSymbol ), CompareSymbols );
+}
+
+// PT_LOAD segments go where their physical address says.  Only their
+// file size is read, the BSS past it is left to the zero pages underneath.
+static int LoadElf( FILE * f, const struct ElfHeader * eh, uint32_t * image_end )
+{
+	if( eh->ident[4] != 1 || eh->ident[5] != 1 || eh->machine != ELF_EM_RISCV || eh->phentsize != sizeof( struct ElfProgramHeader ) )
+	{
+		fprintf( stderr, "Error: \"%s\" is not a 32-bit little endian RISC-V ELF\n", bios_file_name );
+		return -7;
+	}
+	uint32_t i;
+	*image_end = 0;
+	for( i = 0; i < eh->phnum; i++ )
+	{
+		struct ElfProgramHeader ph;
+		if( ReadAt( f, eh->phoff + i * sizeof( ph ), (uint8_t*)&ph, sizeof( ph ) ) )
+		{
+			fprintf( stderr, "Error: Could not load image.\n" );
+			return -7;
+		}
+		if( ph.type != ELF_PT_LOAD || !ph.memsz ) continue;
+		uint32_t addr = ph.paddr - MINIRV32_RAM_IMAGE_OFFSET;
+		if( ph.filesz > ph.memsz || addr >= ram_amt || ph.memsz > ram_amt - addr )
+		{
+			fprintf( stderr, "Error: Could not fit segment at 0x%08x (%u bytes) into RAM\n", ph.paddr, ph.memsz );
+			return -6;
+		}
+		if( ReadAt( f, ph.offset, ram_image + addr, ph.filesz ) )
+		{
+			fprintf( stderr, "Error: Could not load image.\n" );
+			return -7;
+		}
+		if( addr + ph.filesz > *image_end ) *image_end = addr + ph.filesz;
+	}
+	LoadSymbols( f, eh );
+	return 0;
+}
+
+// The symbol from the ELF covering addr, with addr's offset into it, or 0.
+static const char * SymbolAt( uint32_t addr, uint32_t * ofs )
+{
+	uint32_t lo = 0, hi = symbol_count;
+	while( lo < hi )
+	{
+		uint32_t mid = ( lo + hi ) / 2;
+		if( symbols[mid].value <= addr ) lo = mid + 1;
+		else hi = mid;
+	}
+	if( !lo ) return 0;
+	const struct ElfSymbol * s = &symbols[lo - 1];
+	if( s->size && addr - s->value >= s->size ) return 0;
+	*ofs = addr - s->value;
+	return symbol_names + s->name;
+}
+
+static int LoadImage()
+{
+	FILE * f = fopen( bios_file_name, "rb" );
+	if( !f || ferror( f ) )
+	{
+		fprintf( stderr, "Error: \"%s\" not found\n", bios_file_name );
+		return -5;
+	}
+	fseek( f, 0, SEEK_END );
+	long flen = ftell( f );
+	fseek( f, 0, SEEK_SET );
+
+	// Fresh zero pages, whatever the last run dirtied is dropped, then the
+	// image read over them, so only its pages and the ones the guest
+	// touches are ever filled in.  It's read, not mapped, so the file can
+	// be rebuilt in place while the guest runs.
+	ZeroPages( ram_image, ram_amt );
+	FreeSymbols();
+	struct ElfHeader eh;
+	uint32_t entry = MINIRV32_RAM_IMAGE_OFFSET, image_end = flen;
+	memset( &eh, 0, sizeof( eh ) ); // A truncated one fails LoadElf's checks.
+	if( fread( &eh, 1, sizeof( eh ), f ) >= 4 && !memcmp( eh.ident, "\x7f" "ELF", 4 ) )
+	{
+		int ret = LoadElf( f, &eh, &image_end );
+		fclose( f );
+		if( ret ) return ret;
+		entry = eh.entry;
+	}
+	else
+	{
+		if( flen > ram_amt )
+		{
+			fprintf( stderr, "Error: Could not fit RAM image (%ld bytes) into %d\n", flen, ram_amt );
+			return -6;
+		}
+		if( ReadAt( f, 0, ram_image, flen ) )
+		{
+			fprintf( stderr, "Error: Could not load image.\n" );
+			return -7;
 		}
-		uint64_t * this_ccount = ((uint64_t*)&core->cyclel);
+		fclose( f );
+	}
+
+	// The core lives at the end of RAM.
+	core = (struct MiniRV32IMAState *)(ram_image + ram_amt - sizeof( struct MiniRV32IMAState ));
+	core->pc = entry;
+	core->regs[10] = 0x00; //hart ID
+	core->extraflags |= 3; // Machine-mode.
+	time_base = 0;
+
+	irq_enable = 0;
+	blit_status = 0;
+	MiniRV32IMAFlushDecodeCache( dcache );
+	image_hash = HashImage( ram_image, image_end );
+	LoadTranslationCache();
+	ResetDisplay();
+	return 0;
+}
+
+static int CPUThread( void * unused )
+{
+	int ret = 0;
+	uint64_t rt;
+	uint64_t * this_ccount;
+
+	goto start;
+restart:
+	ret = LoadImage();
+	if( ret )
+	{
+		SDL_AtomicSet( &cpu_done, 1 );
+		return ret;
+	}
+start:
+	// Image is loaded, or a snapshot restored.  Pick up its clocks from
+	// where they are, vblanks stay on the same grid of guest time.
+	// With -l the timer is where the last slice left lastTime, and catches
+	// up to the instruction count plus time_base in the next one.
+	this_ccount = ((uint64_t*)&core->cyclel);
+	uint64_t timer = ((uint64_t)core->timerh << 32) | core->timerl;
+	uint64_t lastTime = (fixed_update)?timer:(GetTimeMicroseconds()/time_divisor);
+	uint64_t next_vblank = ( timer / framebuffer_interval + 1 ) * framebuffer_interval;
+	frame_number = next_vblank / framebuffer_interval - 1;
+	int instrs_per_flip = SLICE_MIN;
+	uint64_t run_start = GetTimeMicroseconds();
+	// Without -l, how fast the guest runs, to turn time into instructions.
+	double instrs_per_us = 1;
+	uint64_t rate_instrs = 0, rate_us = 0, last_tick = run_start;
+	uint64_t pace_start = run_start, pace_instrs = *this_ccount;
+	for( rt = 0; ( rt < instct+1 || instct < 0 ) && !SDL_AtomicGet( &cpu_quit ); rt += instrs_per_flip )
+	{
+		// Locked to the instruction count, guest time doesn't need the clock.
+		uint64_t tick_start = ( fixed_update && !cpu_hz ) ? 0 : GetTimeMicroseconds();
+
 		uint32_t elapsedUs = 0;
 		if( fixed_update )
-			elapsedUs = *this_ccount / time_divisor - lastTime;
+			elapsedUs = *this_ccount / time_divisor + time_base - lastTime;
 		else
-			elapsedUs = GetTimeMicroseconds()/time_divisor - lastTime;
+		{
+			elapsedUs = tick_start/time_divisor - lastTime;
+			rate_us += tick_start - last_tick;
+			last_tick = tick_start;
+			if( rate_us >= SLICE_MAX_US )
+			{
+				instrs_per_us = (double)rate_instrs / rate_us;
+				if( instrs_per_us < 1 ) instrs_per_us = 1;
+				rate_instrs = rate_us = 0;
+			}
+		}
 		lastTime += elapsedUs;
 
-		int ret = MiniRV32IMAStep( core, ram_image, 0, elapsedUs, instrs_per_flip ); // Execute upto 1024 cycles before breaking out.
+		uint64_t guest_time = ( ((uint64_t)core->timerh << 32) | core->timerl ) + elapsedUs;
+		uint64_t vblank = next_vblank;
+		if( !headless )
+		{
+			int32_t until = SDL_AtomicGet( &framebuffer_vblank_due ) - (uint32_t)tick_start;
+			vblank = ( until > 0 ) ? guest_time + until / time_divisor + 1 : 0;
+		}
+		instrs_per_flip = SliceBudget( guest_time, vblank, fixed_update ? time_divisor : ( cpu_hz ? cpu_hz / 1e6 : instrs_per_us ) * time_divisor );
+		if( instct >= 0 && instrs_per_flip > instct + 1 - rt )
+			instrs_per_flip = instct + 1 - rt;
+
+		int ret = StepCore( elapsedUs, instrs_per_flip );
 		switch( ret )
 		{
-			case 0: break;
-			case 1: if( do_sleep ) MiniSleep(); *this_ccount += instrs_per_flip; break;
+			case 0: rate_instrs += instrs_per_flip; break;
+			case 1:
+			{
+				UartKick();
+				if( !do_sleep ) { *this_ccount += instrs_per_flip; break; }
+				// Locked to the instruction count there's no deadline in
+				// real time, just don't spin.
+				uint64_t us = fixed_update ? 500 : IDLE_MAX_US;
+				uint64_t now = ((uint64_t)core->timerh << 32) | core->timerl;
+				uint64_t match = ((uint64_t)core->timermatchh << 32) | core->timermatchl;
+				if( !fixed_update && match && match >= now && ( match + 1 - now ) * time_divisor < us )
+					us = ( match + 1 - now ) * time_divisor;
+				WaitForEvent( us );
+				last_tick = GetTimeMicroseconds(); // Not running, keep it out of instrs_per_us.
+				*this_ccount += instrs_per_flip;
+				// Idle time was real time already, unless guest time is
+				// the instruction count, then the skip has to be paced.
+				if( !fixed_update )
+				{
+					pace_start = last_tick;
+					pace_instrs = *this_ccount;
+				}
+				break;
+			}
 			case 3: instct = 0; break;
-			case 0x7777: goto restart;	//syscon code for restart
-			case 0x5555: printf( "POWEROFF@0x%08x%08x\n", core->cycleh, core->cyclel ); return 0; //syscon code for power-off
-			default: printf( "Unknown failure\n" ); break;
+			case 0x7777: SaveTranslationCache(); goto restart;	//syscon code for restart
+			case 0x5555: SaveTranslationCache(); UartDrain(); printf( "POWEROFF@0x%08x%08x\n", core->cycleh, core->cyclel ); SDL_AtomicSet( &cpu_done, 1 ); return 0; //syscon code for power-off
+			default: UartDrain(); printf( "Unknown failure\n" ); break;
 		}
 
-		if (LIMITED_CPU) {
-		// cpu limit speed	
-			uint64_t tick_end = GetTimeMicroseconds();
-			uint64_t tick_duration_us = tick_end - tick_start;
+		if( SDL_AtomicGet( &snapshot_request ) )
+		{
+			SDL_AtomicSet( &snapshot_request, 0 );
+			SaveSnapshot();
+		}
 
-			uint64_t expected_us = ((uint64_t)instrs_per_flip * 1000000ULL) / TARGET_HZ;
+		guest_time = ((uint64_t)core->timerh << 32) | core->timerl;
+		if( headless && guest_time >= next_vblank )
+		{
+			CaptureFrame();
+			SDL_AtomicSet( &framebuffer_vblank, 1 );
+			next_vblank += framebuffer_interval;
+			if( next_vblank <= guest_time )
+				next_vblank = guest_time + framebuffer_interval;
+		}
 
-			if( tick_duration_us < expected_us )
+		if( cpu_hz )
+		{
+			uint64_t now = GetTimeMicroseconds();
+			double ahead = pace_start + ( *this_ccount - pace_instrs ) * 1e6 / cpu_hz - now;
+			if( ahead >= PACE_SLEEP_US )
+				IdleWait( ahead );
+			else if( ahead < -PACE_BEHIND_MAX_US )
 			{
-		    		usleep(expected_us - tick_duration_us);
+				pace_start = now;
+				pace_instrs = *this_ccount;
 			}
 		}
-		
 	}
+	uint64_t run_us = GetTimeMicroseconds() - run_start;
+	SaveTranslationCache();
+	if( SDL_AtomicGet( &cpu_quit ) )
+	{
+		SDL_AtomicSet( &cpu_done, 1 );
+		return 0;
+	}
+	uint64_t run_instrs = ((uint64_t)core->cycleh << 32) | core->cyclel;
+	UartDrain();
+	printf( "%llu instructions in %llu us (%.2f MIPS)\n", (unsigned long long)run_instrs, (unsigned long long)run_us, run_us ? (double)run_instrs / run_us : 0.0 );
 	DumpState( core, ram_image);
+	SDL_AtomicSet( &cpu_done, 1 );
+	return ret;
+}
+
+// Sleeps in wfi until another thread has something that could wake the
+// guest, or for us microseconds.
+static void WaitForEvent( uint64_t us )
+{
+	SDL_AtomicSet( &cpu_idle, 1 );
+	if( !SDL_AtomicGet( &cpu_quit ) && !MINIRV32_EXTERNAL_INTERRUPT )
+		IdleWait( us );
+	SDL_AtomicSet( &cpu_idle, 0 );
+}
+
+static void WakeCPU()
+{
+	if( SDL_AtomicGet( &cpu_idle ) )
+		IdleWake();
+}
+
+// Instructions from guest_time to the next deadline, at instrs_per_us
+// per microsecond of guest time.  next_vblank is 0 if it's not known.
+static int SliceBudget( uint64_t guest_time, uint64_t next_vblank, double instrs_per_us )
+{
+	uint64_t due = guest_time + SLICE_MAX_US;
+	uint64_t match = ((uint64_t)core->timermatchh << 32) | core->timermatchl;
+	if( match && match >= guest_time && match + 1 < due )
+		due = match + 1; // Pending once the timer is past the match.
+	if( next_vblank > guest_time && next_vblank < due )
+		due = next_vblank;
+	double n = ( due - guest_time ) * instrs_per_us;
+	if( fixed_update ) // Exact, the timer is the instruction count over time_divisor, plus time_base.
+		n = ( due - time_base ) * time_divisor - ( ((uint64_t)core->cycleh << 32) | core->cyclel );
+	else if( n < SLICE_MIN )
+		n = SLICE_MIN;
+	return n > 1<<30 ? 1<<30 : n;
 }
 
 
@@ -289,9 +1093,55 @@ static void ResetKeyboardInput()
 {
 }
 
-static void MiniSleep()
+static void * AllocPages( uint64_t len )
+{
+	return VirtualAlloc( 0, len, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE );
+}
+
+// Decommitted pages come back zeroed on first touch.
+static void ZeroPages( void * addr, uint64_t len )
+{
+	VirtualFree( addr, len, MEM_DECOMMIT );
+	VirtualAlloc( addr, len, MEM_COMMIT, PAGE_READWRITE );
+}
+
+// len bytes of path, shared and writable, the file is created or grown.
+static uint8_t * MapFile( const char * path, uint64_t len )
+{
+	HANDLE file = CreateFileA( path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, 0, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0 );
+	if( file == INVALID_HANDLE_VALUE ) return 0;
+	HANDLE mapping = CreateFileMappingA( file, 0, PAGE_READWRITE, (DWORD)( len >> 32 ), (DWORD)len, 0 );
+	void * map = mapping ? MapViewOfFile( mapping, FILE_MAP_WRITE, 0, 0, len ) : 0;
+	if( mapping ) CloseHandle( mapping );
+	CloseHandle( file );
+	return map;
+}
+
+static void UnmapFile( uint8_t * map, uint64_t len )
+{
+	UnmapViewOfFile( map );
+}
+
+static void SyncFile( uint8_t * map, uint64_t len )
+{
+	FlushViewOfFile( map, len );
+}
+
+static HANDLE idle_event;
+
+static void IdleInit()
+{
+	idle_event = CreateEvent( 0, FALSE, FALSE, 0 );
+}
+
+static void IdleWait( uint64_t us )
+{
+	WaitForSingleObject( idle_event, (DWORD)( ( us + 999 ) / 1000 ) );
+}
+
+static void IdleWake()
 {
-	Sleep(1);
+	SetEvent( idle_event );
 }
 
 static uint64_t GetTimeMicroseconds()
@@ -307,11 +1157,6 @@ static uint64_t GetTimeMicroseconds()
 }
 
 
-static int IsKBHit()
-{
-	return _kbhit();
-}
-
 static int ReadKBByte()
 {
 	// This code is kind of tricky, but used to convert windows arrow keys
@@ -353,14 +1198,17 @@ static int ReadKBByte()
 
 #else
 
-#include <sys/ioctl.h>
 #include <termios.h>
+#include <fcntl.h>
+#include <sys/select.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <signal.h>
-#include <sys/time.h>
+#include <time.h>
 
 static void CtrlC(int sig)
 {
+	if( uart_tx_lock ) UartDrain();
 	DumpState( core, ram_image);
 	exit( 0 );
 }
@@ -387,24 +1235,87 @@ static void ResetKeyboardInput()
 	tcsetattr(0, TCSANOW, &term);
 }
 
-static void MiniSleep()
+static void * AllocPages( uint64_t len )
 {
-	usleep(500);
+	void * p = mmap( 0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+	return ( p == MAP_FAILED ) ? 0 : p;
 }
 
-static uint64_t GetTimeMicroseconds()
+// A new anonymous mapping in place, also drops any file mapped there.
+static void ZeroPages( void * addr, uint64_t len )
+{
+	if( mmap( addr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0 ) == MAP_FAILED )
+		memset( addr, 0, len );
+}
+
+// len bytes of path, shared and writable, the file is created or resized.
+static uint8_t * MapFile( const char * path, uint64_t len )
+{
+	int fd = open( path, O_RDWR | O_CREAT, 0644 );
+	if( fd < 0 ) return 0;
+	void * map = ftruncate( fd, len ) ? MAP_FAILED : mmap( 0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	close( fd );
+	return ( map == MAP_FAILED ) ? 0 : map;
+}
+
+static void UnmapFile( uint8_t * map, uint64_t len )
+{
+	munmap( map, len );
+}
+
+// Returns once what's been written through map is on disk.
+static void SyncFile( uint8_t * map, uint64_t len )
+{
+	msync( map, len, MS_SYNC );
+}
+
+// Self pipe, so the wait can be woken from other threads and still time
+// out to the microsecond.
+static int idle_pipe[2] = { -1, -1 };
+
+static void IdleInit()
+{
+	if( pipe( idle_pipe ) == 0 )
+	{
+		fcntl( idle_pipe[0], F_SETFL, O_NONBLOCK );
+		fcntl( idle_pipe[1], F_SETFL, O_NONBLOCK );
+	}
+}
+
+static void IdleWait( uint64_t us )
+{
+	fd_set set;
+	struct timespec ts = { us / 1000000, ( us % 1000000 ) * 1000 };
+	FD_ZERO( &set );
+	if( idle_pipe[0] < 0 ) { nanosleep( &ts, 0 ); return; }
+	FD_SET( idle_pipe[0], &set );
+	if( pselect( idle_pipe[0] + 1, &set, 0, 0, &ts, 0 ) > 0 )
+	{
+		char drain[64];
+		while( read( idle_pipe[0], drain, sizeof( drain ) ) > 0 );
+	}
+}
+
+static void IdleWake()
 {
-	struct timeval tv;
-	gettimeofday( &tv, 0 );
-	return tv.tv_usec + ((uint64_t)(tv.tv_sec)) * 1000000LL;
+	char c = 0;
+	ssize_t r = write( idle_pipe[1], &c, 1 ); // Full is fine, it's awake.
+	(void)r;
 }
 
-static int is_eofd;
+// Monotonic, so NTP and clock changes don't move guest time.  A vDSO call,
+// no syscall.
+static uint64_t GetTimeMicroseconds()
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_nsec / 1000 + ((uint64_t)(ts.tv_sec)) * 1000000LL;
+}
 
+// Blocks until there's a byte, -1 at end of file.
 static int ReadKBByte()
 {
-	if( is_eofd ) return 0xffffffff;
-	char rxchar = 0;
+	uint8_t rxchar = 0;
 	int rread = read(fileno(stdin), (char*)&rxchar, 1);
 
 	if( rread > 0 ) // Tricky: getchar can't be used with arrow keys.
@@ -413,15 +1324,6 @@ static int ReadKBByte()
 		return -1;
 }
 
-static int IsKBHit()
-{
-	if( is_eofd ) return -1;
-	int byteswaiting;
-	ioctl(0, FIONREAD, &byteswaiting);
-	if( !byteswaiting && write( fileno(stdin), 0, 0 ) != 0 ) { is_eofd = 1; return -1; } // Is end-of-file for 
-	return !!byteswaiting;
-}
-
 
 #endif
 
@@ -430,83 +1332,1398 @@ static int IsKBHit()
 // Rest of functions functionality
 //////////////////////////////////////////////////////////////////////////
 
-static uint32_t HandleException( uint32_t ir, uint32_t code )
+static int ParseEngine( const char * name )
 {
-	// Weird opcode emitted by duktape on exit.
-	if( code == 3 )
+	if( strcmp( name, "interp" ) == 0 ) return ENGINE_REFERENCE;
+	if( strcmp( name, "cache" ) == 0 ) return ENGINE_DECODE_CACHE;
+#ifdef MINIRV32_JIT_AVAILABLE
+	if( strcmp( name, "jit" ) == 0 ) return ENGINE_JIT;
+#endif
+	return -1;
+}
+
+// The -o pattern is handed to snprintf with the frame number, so it must
+// have exactly one integer conversion, and %% for any other percent sign.
+static int CheckFramePattern( const char * pattern )
+{
+	int conversions = 0;
+	const char * p;
+	for( p = pattern; *p; p++ )
 	{
-		// Could handle other opcodes here.
+		if( *p != '%' ) continue;
+		if( *++p == '%' ) continue;
+		p += strspn( p, "-+ #0" );
+		p += strspn( p, "0123456789." );
+		if( !*p || !strchr( "diouxX", *p ) ) return 0;
+		conversions++;
 	}
-	return code;
+	return conversions == 1;
 }
 
-static uint32_t HandleControlStore( uint32_t addy, uint32_t val )
+static int32_t StepCore( uint32_t elapsedUs, int count )
 {
-	if ( addy > 0x0FFFFFFF && addy < 0x10038008 ) { //mmio
-		//UART 8250 / 16550 Data Buffer
-		if( addy == 0x10000000 )
-		{
-			printf( "%c", val );
-			fflush( stdout );
-			return 0;
-		}
-		//frame buffer swap
-		else if( addy == 0x10038004 ) {
-			memcpy(framebuffer_buffer, framebuffer_addr, FRAMEBUFFER_SIZE8);
-			return 0;
-		}
-		uint32_t *mmio_store_access = (uint32_t *)(mmio_image + addy - 0x10000000);
-		*mmio_store_access = val;
-		return 0;
-	}
-	// CLNT
-	if ( addy == 0x11004004 )
-		core->timermatchh = val;
-	else if ( addy == 0x11004000 )
-		core->timermatchl = val;
-	// SYSCON (reboot, poweroff, etc.)	
-	else if ( addy == 0x11100000 ) {
-		core->pc = core->pc + 4;
-		return val;
+	switch( cpu_engine )
+	{
+	case ENGINE_DECODE_CACHE: return MiniRV32IMAStepCached( core, ram_image, 0, elapsedUs, count, dcache );
+#ifdef MINIRV32_JIT_AVAILABLE
+	case ENGINE_JIT: return MiniRV32IMAStepJit( core, ram_image, 0, elapsedUs, count, jit );
+#endif
+	default: return MiniRV32IMAStep( core, ram_image, 0, elapsedUs, count );
 	}
-	return 0;
 }
 
-
-static uint32_t HandleControlLoad( uint32_t addy )
+// FNV-1a over the loaded image, keys the translation cache.
+static uint64_t HashImage( const uint8_t * image, uint32_t len )
 {
-	if ( addy > 0x0FFFFFFF && addy < 0x12000001 ){
-		// Emulating a 8250 / 16550 UART
-		if( addy == 0x10000005 )
-			return 0x60 | IsKBHit();
-		else if( addy == 0x10000000 && IsKBHit() )
-			return ReadKBByte();
-		//framebuffer vblank
-		else if ( addy == 0x10038000 ) {
-			uint32_t *vblank_ptr = (uint32_t *)(mmio_image + (0x10038000 - 0x10000000));
-			uint32_t val = *vblank_ptr;
-			*vblank_ptr = 0;
-			return val;
-		}
-		else if( addy == 0x1100bffc ) // https://chromitem-soc.readthedocs.io/en/latest/clint.html
-			return core->timerh;
-		else if( addy == 0x1100bff8 )
-			return core->timerl;
-		uint32_t *mmio_load_access = (uint32_t *)(mmio_image + addy - 0x10000000);
-		return *mmio_load_access;
+	uint64_t hash = 0xcbf29ce484222325ULL ^ len;
+	uint32_t i;
+	for( i = 0; i < len; i++ )
+		hash = ( hash ^ image[i] ) * 0x100000001b3ULL;
+	return hash;
+}
+
+// On-disk translation cache: decode cache entries, then the guest PC of
+// each JIT block.  Decode entries go back in as they are once the checksum
+// over the file matches.  JIT host code has this process's addresses in
+// it, so the block PCs are only a prefetch list, translated again at load
+// instead of on first use.
+#define TCACHE_VERSION 2
+struct TranslationCacheHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t entry_size;
+	uint32_t op_count;
+	uint64_t image_hash;
+	uint32_t entries;
+	uint32_t blocks;
+	uint64_t checksum; // HashImage of everything after the header.
+};
+
+static void TranslationCachePath( char * path, int len, const char * suffix )
+{
+	snprintf( path, len, "%s/%016llx.rvtc%s", tcache_dir, (unsigned long long)image_hash, suffix );
+}
+
+static void LoadTranslationCache()
+{
+	if( !tcache_dir ) return;
+
+	char path[1024];
+	TranslationCachePath( path, sizeof( path ), "" );
+	FILE * f = fopen( path, "rb" );
+	if( !f ) return;
+
+	struct TranslationCacheHeader h;
+	if( fread( &h, sizeof( h ), 1, f ) != 1 || memcmp( h.magic, "RVTC", 4 ) || h.version != TCACHE_VERSION ||
+		h.entry_size != sizeof( struct MiniRV32IMADecoded ) || h.op_count != MINIRV32_OP_COUNT || h.image_hash != image_hash ||
+		h.entries > MINIRV32_DECODE_CACHE_ENTRIES || h.blocks > MINIRV32_DECODE_CACHE_ENTRIES )
+	{
+		fclose( f );
+		return;
+	}
+
+	uint32_t i, len = h.entries * sizeof( struct MiniRV32IMADecoded ) + h.blocks * sizeof( uint32_t );
+	uint8_t * payload = malloc( len + 1 );
+	int ok = payload && fread( payload, 1, len + 1, f ) == len && HashImage( payload, len ) == h.checksum;
+	fclose( f );
+	if( !ok )
+	{
+		free( payload );
+		return;
+	}
+
+	const struct MiniRV32IMADecoded * d = (const struct MiniRV32IMADecoded *)payload;
+	for( i = 0; i < h.entries; i++ )
+		MiniRV32IMAInstallDecoded( dcache, ram_image, &d[i] );
+
+#ifdef MINIRV32_JIT_AVAILABLE
+	const uint32_t * pcs = (const uint32_t *)( d + h.entries );
+	for( i = 0; jit && i < h.blocks; i++ )
+		MiniRV32IMAJitTranslateAt( jit, ram_image, pcs[i] );
+#endif
+	free( payload );
+}
+
+static void SaveTranslationCache()
+{
+	if( !tcache_dir ) return;
+
+	// Write to a temporary file of our own and move it in place, so
+	// concurrent runs never see, or write into, half a cache.
+	char path[1024], tmp_path[1024], suffix[32];
+	TranslationCachePath( path, sizeof( path ), "" );
+	snprintf( suffix, sizeof( suffix ), ".%d.tmp", (int)getpid() );
+	TranslationCachePath( tmp_path, sizeof( tmp_path ), suffix );
+	FILE * f = fopen( tmp_path, "wb" );
+	if( !f )
+	{
+		fprintf( stderr, "Warning: could not write translation cache \"%s\"\n", tmp_path );
+		return;
+	}
+
+	struct TranslationCacheHeader h = { { 'R', 'V', 'T', 'C' }, TCACHE_VERSION, sizeof( struct MiniRV32IMADecoded ), MINIRV32_OP_COUNT, image_hash, 0, 0, 0 };
+	int i;
+	for( i = 0; i < MINIRV32_DECODE_CACHE_ENTRIES; i++ )
+		if( dcache->entries[i].pc != MINIRV32_DECODE_EMPTY ) h.entries++;
+#ifdef MINIRV32_JIT_AVAILABLE
+	for( i = 0; jit && i < MINIRV32_JIT_BLOCKS; i++ )
+		if( jit->blocks[i].code ) h.blocks++;
+	if( h.blocks > MINIRV32_DECODE_CACHE_ENTRIES ) h.blocks = MINIRV32_DECODE_CACHE_ENTRIES;
+#endif
+
+	// Gathered first, the checksum goes in the header.
+	uint32_t len = h.entries * sizeof( struct MiniRV32IMADecoded ) + h.blocks * sizeof( uint32_t );
+	uint8_t * payload = malloc( len );
+	int ok = payload != 0;
+	if( ok )
+	{
+		struct MiniRV32IMADecoded * d = (struct MiniRV32IMADecoded *)payload;
+		for( i = 0; i < MINIRV32_DECODE_CACHE_ENTRIES; i++ )
+			if( dcache->entries[i].pc != MINIRV32_DECODE_EMPTY )
+				*d++ = dcache->entries[i];
+#ifdef MINIRV32_JIT_AVAILABLE
+		uint32_t * pcs = (uint32_t *)d, n = 0;
+		for( i = 0; jit && i < MINIRV32_JIT_BLOCKS && n < h.blocks; i++ )
+			if( jit->blocks[i].code )
+				pcs[n++] = jit->blocks[i].pc;
+#endif
+		h.checksum = HashImage( payload, len );
+		ok = fwrite( &h, sizeof( h ), 1, f ) == 1 && fwrite( payload, 1, len, f ) == len;
+	}
+	free( payload );
+	if( fclose( f ) || !ok )
+	{
+		fprintf( stderr, "Warning: could not write translation cache \"%s\"\n", tmp_path );
+		remove( tmp_path );
+		return;
+	}
+	remove( path ); // rename() won't replace an existing file on Windows.
+	rename( tmp_path, path );
+}
+
+// Display registers, in SnapshotHeader.regs.  Scanout's buffer is whichever
+// of the three back and ready don't have.
+static SDL_atomic_t * const snapshot_regs[] = {
+	&framebuffer_back, &framebuffer_ready, &framebuffer_vblank, &framebuffer_mode,
+	&layer_enable, &layer_tile_sheet, &layer_tile_map, &layer_sprites,
+	&surface_addr, &surface_width, &surface_height, &surface_scroll_x, &surface_scroll_y, &surface_line_scroll,
+	&text_cells, &text_cursor,
+};
+
+struct SnapshotHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t ram_amt;
+	uint32_t mmio_size;
+	uint32_t framebuffer_size;
+	uint32_t mmio_ofs;
+	uint32_t framebuffer_ofs;
+	uint32_t ram_ofs;
+	uint64_t image_hash;
+	int64_t time_base;
+	uint32_t time_divisor; // With -l, or 0.
+	uint32_t framebuffer_count;
+	uint32_t irq_enable;
+	uint32_t blit_status;
+	uint32_t blit_regs[BLIT_STATUS >> 2];
+	uint32_t regs[sizeof( snapshot_regs ) / sizeof( snapshot_regs[0] )];
+	uint32_t palette[256];
+};
+
+#define SNAPSHOT_ROUND( n ) ( ( (n) + SNAPSHOT_PAGE - 1 ) & ~( SNAPSHOT_PAGE - 1 ) )
+static void SnapshotLayout( struct SnapshotHeader * h )
+{
+	memcpy( h->magic, "VCSN", 4 );
+	h->version = SNAPSHOT_VERSION;
+	h->ram_amt = ram_amt;
+	h->mmio_size = mmio_size;
+	h->framebuffer_size = FRAMEBUFFER_SIZE8;
+	h->mmio_ofs = SNAPSHOT_ROUND( sizeof( struct SnapshotHeader ) );
+	h->framebuffer_ofs = h->mmio_ofs + SNAPSHOT_ROUND( mmio_size );
+	h->ram_ofs = h->framebuffer_ofs + SNAPSHOT_ROUND( FRAMEBUFFER_SIZE8 * FRAMEBUFFER_COUNT );
+}
+
+// Copies the pages of src that differ from dst, returns how many.
+static uint32_t SnapshotPages( uint8_t * dst, const uint8_t * src, uint32_t len )
+{
+	uint32_t ofs, n = 0;
+	for( ofs = 0; ofs < len; ofs += SNAPSHOT_PAGE )
+	{
+		uint32_t run = ( len - ofs < SNAPSHOT_PAGE ) ? len - ofs : SNAPSHOT_PAGE;
+		if( memcmp( dst + ofs, src + ofs, run ) )
+		{
+			memcpy( dst + ofs, src + ofs, run );
+			n++;
+		}
 	}
+	return n;
+}
+
+// On the cpu thread, between slices.
+static int SaveSnapshot()
+{
+	uint64_t start = GetTimeMicroseconds();
+	struct SnapshotHeader h;
+	int i;
+	memset( &h, 0, sizeof( h ) );
+	SnapshotLayout( &h );
+	uint64_t len = (uint64_t)h.ram_ofs + ram_amt;
+	uint8_t * map = MapFile( snapshot_file, len );
+	if( !map )
+	{
+		fprintf( stderr, "Warning: could not write snapshot \"%s\"\n", snapshot_file );
+		return -1;
+	}
+
+	h.image_hash = image_hash;
+	h.time_base = time_base;
+	h.time_divisor = fixed_update ? time_divisor : 0;
+	h.framebuffer_count = framebuffer_count;
+	h.irq_enable = irq_enable;
+	h.blit_status = blit_status;
+	memcpy( h.blit_regs, blit_regs, sizeof( h.blit_regs ) );
+	for( i = 0; i < sizeof( snapshot_regs ) / sizeof( snapshot_regs[0] ); i++ )
+		h.regs[i] = SDL_AtomicGet( snapshot_regs[i] );
+	memcpy( h.palette, framebuffer_palette, sizeof( h.palette ) );
+
+	// The pages are overwritten in place, so the file says it's incomplete
+	// until they're all on disk, then the header commits them.  A save
+	// that's cut short can't be restored as a mix of two.
+	memset( map, 0, sizeof( h.magic ) );
+	SyncFile( map, SNAPSHOT_PAGE );
+	uint32_t pages = SnapshotPages( map + h.mmio_ofs, mmio_image, mmio_size );
+	for( i = 0; i < FRAMEBUFFER_COUNT; i++ )
+		pages += SnapshotPages( map + h.framebuffer_ofs + i * FRAMEBUFFER_SIZE8, framebuffers[i], FRAMEBUFFER_SIZE8 );
+	pages += SnapshotPages( map + h.ram_ofs, ram_image, ram_amt );
+	SyncFile( map, len );
+	memcpy( map, &h, sizeof( h ) );
+	SyncFile( map, SNAPSHOT_PAGE );
+	UnmapFile( map, len );
+	fprintf( stderr, "Snapshot \"%s\": %u pages in %llu us\n", snapshot_file, pages, (unsigned long long)( GetTimeMicroseconds() - start ) );
+	return 0;
+}
+
+// Before the threads start.  Nothing to restore isn't an error, the guest
+// boots and can save one later.
+static int RestoreSnapshot()
+{
+	FILE * f = fopen( snapshot_file, "rb" );
+	if( !f ) return 0;
+
+	struct SnapshotHeader h, layout;
+	int i;
+	memset( &h, 0xff, sizeof( h ) ); // A short file fails the layout check.
+	memset( &layout, 0, sizeof( layout ) );
+	SnapshotLayout( &layout );
+	if( fread( &h, sizeof( h ), 1, f ) == 1 && !memcmp( h.magic, "\0\0\0\0", 4 ) )
+	{
+		fclose( f );
+		fprintf( stderr, "Error: snapshot \"%s\" is incomplete, saving it was interrupted\n", snapshot_file );
+		return -8;
+	}
+	if( memcmp( &h, &layout, offsetof( struct SnapshotHeader, image_hash ) ) )
+	{
+		fclose( f );
+		fprintf( stderr, "Error: \"%s\" is not a snapshot of this machine\n", snapshot_file );
+		return -8;
+	}
+	// The snapshot holds all of RAM, running it would ignore -b entirely.
+	if( h.image_hash != image_hash )
+	{
+		fclose( f );
+		fprintf( stderr, "Error: snapshot \"%s\" was taken from a different image than \"%s\", remove it to boot this one\n", snapshot_file, bios_file_name );
+		return -8;
+	}
+	int ok = !fseek( f, h.mmio_ofs, SEEK_SET ) && fread( mmio_image, mmio_size, 1, f ) == 1;
+	for( i = 0; ok && i < FRAMEBUFFER_COUNT; i++ )
+		ok = !fseek( f, h.framebuffer_ofs + i * FRAMEBUFFER_SIZE8, SEEK_SET ) && fread( framebuffers[i], FRAMEBUFFER_SIZE8, 1, f ) == 1;
+	// RAM is read, not mapped, so another instance saving to the same file
+	// can't change it underneath this one.  Pages that are all zero are
+	// left to ZeroPages, RAM the guest never used stays untouched.
+	if( ok )
+	{
+		static const uint8_t zero[SNAPSHOT_PAGE];
+		uint8_t page[SNAPSHOT_PAGE];
+		uint32_t ofs, n;
+		ZeroPages( ram_image, ram_amt );
+		ok = !fseek( f, h.ram_ofs, SEEK_SET );
+		for( ofs = 0; ok && ofs < ram_amt; ofs += n )
+		{
+			n = ( ram_amt - ofs < SNAPSHOT_PAGE ) ? ram_amt - ofs : SNAPSHOT_PAGE;
+			ok = fread( page, n, 1, f ) == 1;
+			if( ok && memcmp( page, zero, n ) )
+				memcpy( ram_image + ofs, page, n );
+		}
+	}
+	fclose( f );
+	if( !ok )
+	{
+		fprintf( stderr, "Error: could not read snapshot \"%s\"\n", snapshot_file );
+		return -8;
+	}
+
+	// Saved with the same -l and -T, time goes on as it would have.
+	// Otherwise the timer starts following the instruction count from
+	// where it is, instead of jumping to the count over time_divisor.
+	if( fixed_update && h.time_divisor == time_divisor )
+		time_base = h.time_base;
+	else
+		time_base = ( ((uint64_t)core->timerh << 32) | core->timerl ) - ( ((uint64_t)core->cycleh << 32) | core->cyclel ) / time_divisor;
+	framebuffer_count = h.framebuffer_count;
+	irq_enable = h.irq_enable;
+	blit_status = h.blit_status;
+	memcpy( blit_regs, h.blit_regs, sizeof( blit_regs ) );
+	for( i = 0; i < sizeof( snapshot_regs ) / sizeof( snapshot_regs[0] ); i++ )
+		SDL_AtomicSet( snapshot_regs[i], h.regs[i] );
+	memcpy( framebuffer_palette, h.palette, sizeof( framebuffer_palette ) );
+	SDL_AtomicAdd( &framebuffer_palette_gen, 1 );
+	SetBackBuffer( SDL_AtomicGet( &framebuffer_back ) );
+	framebuffer_scanout = 3 - SDL_AtomicGet( &framebuffer_back ) - ( SDL_AtomicGet( &framebuffer_ready ) & FRAMEBUFFER_INDEX );
+	memset( framebuffer_dirty, 1, sizeof( framebuffer_dirty ) );
+	framebuffer_pending = 1;
+
+	MiniRV32IMAFlushDecodeCache( dcache );
+	LoadTranslationCache();
+	return 0;
+}
+
+static uint32_t HandleException( uint32_t ir, uint32_t code )
+{
+	// Weird opcode emitted by duktape on exit.
+	if( code == 3 )
+	{
+		// Could handle other opcodes here.
+	}
+	return code;
+}
+
+static uint32_t MMIOIgnoreLoad( uint32_t addy )
+{
+	return 0;
+}
+
+static uint32_t MMIOIgnoreStore( uint32_t addy, uint32_t val )
+{
+	return 0;
+}
+
+// Claim [base, base+size) of the MMIO bus.  base has to be granule aligned, size is rounded up.
+static int RegisterMMIO( uint32_t base, uint32_t size, MMIOLoadFn load, MMIOStoreFn store )
+{
+	uint32_t first = ( base - MMIO_BASE ) >> MMIO_GRANULE_SHIFT;
+	uint32_t last = ( base - MMIO_BASE + size - 1 ) >> MMIO_GRANULE_SHIFT;
+	uint32_t i;
+	if( !MINIRV32_MMIO_RANGE( base ) || !size || size > MMIO_END - base || ( base & ( ( 1 << MMIO_GRANULE_SHIFT ) - 1 ) ) ) return -1;
+	if( mmio_device_count == MMIO_MAX_DEVICES ) return -1;
+	for( i = first; i <= last; i++ )
+		if( mmio_map[i] ) return -1;
+
+	struct MMIODevice * d = &mmio_devices[mmio_device_count];
+	d->base = base;
+	d->size = size;
+	d->load = load ? load : MMIOIgnoreLoad;
+	d->store = store ? store : MMIOIgnoreStore;
+	for( i = first; i <= last; i++ )
+		mmio_map[i] = mmio_device_count;
+	mmio_device_count++;
+	return 0;
+}
+
+// Loads and stores to mmio_image, for device memory with no side effects.
+static uint32_t MMIOImageLoad( uint32_t addy )
+{
+	uint32_t ofs = addy - MMIO_BASE;
+	return ( ofs < mmio_size - 3 ) ? *(uint32_t *)( mmio_image + ofs ) : 0;
+}
+
+static uint32_t MMIOImageStore( uint32_t addy, uint32_t val )
+{
+	uint32_t ofs = addy - MMIO_BASE;
+	if( ofs < mmio_size - 3 ) *(uint32_t *)( mmio_image + ofs ) = val;
 	return 0;
 }
 
+// Fills the receive FIFO from stdin, until end of file.  A full FIFO
+// holds the input back until the guest reads some.
+static int InputThread( void * unused )
+{
+	int c;
+	while( ( c = ReadKBByte() ) >= 0 )
+	{
+		uint32_t head = SDL_AtomicGet( &uart_rx_head );
+		while( head - SDL_AtomicGet( &uart_rx_tail ) == UART_RX_SIZE )
+			SDL_Delay( 1 );
+		uart_rx[head % UART_RX_SIZE] = c;
+		SDL_MemoryBarrierRelease();
+		SDL_AtomicSet( &uart_rx_head, head + 1 );
+		WakeCPU();
+	}
+	return 0;
+}
+
+static int UartRxReady()
+{
+	return SDL_AtomicGet( &uart_rx_head ) != SDL_AtomicGet( &uart_rx_tail );
+}
+
+// Next byte from the receive FIFO, -1 if there isn't one.
+static int UartGet()
+{
+	uint32_t tail = SDL_AtomicGet( &uart_rx_tail );
+	if( SDL_AtomicGet( &uart_rx_head ) == tail )
+		return -1;
+	SDL_MemoryBarrierAcquire();
+	int c = uart_rx[tail % UART_RX_SIZE];
+	SDL_AtomicSet( &uart_rx_tail, tail + 1 );
+	return c;
+}
+
+// Writes out everything in the transmit FIFO.  From the uart thread, or
+// from the cpu thread when it can't wait, before the host prints.
+static void UartDrain()
+{
+	SDL_LockMutex( uart_tx_lock );
+	uint32_t head = SDL_AtomicGet( &uart_tx_head );
+	uint32_t tail = SDL_AtomicGet( &uart_tx_tail );
+	if( head != tail )
+	{
+		SDL_MemoryBarrierAcquire();
+		uint32_t ofs = tail % UART_TX_SIZE, len = head - tail;
+		uint32_t first = ( len < UART_TX_SIZE - ofs ) ? len : UART_TX_SIZE - ofs;
+		fwrite( uart_tx + ofs, first, 1, stdout );
+		if( len > first )
+			fwrite( uart_tx, len - first, 1, stdout );
+		fflush( stdout );
+		SDL_AtomicSet( &uart_tx_tail, head );
+	}
+	SDL_UnlockMutex( uart_tx_lock );
+}
+
+static int UartThread( void * unused )
+{
+	int quit;
+	do
+	{
+		SDL_SemWaitTimeout( uart_tx_sem, UART_TX_IDLE_MS );
+		SDL_AtomicSet( &uart_tx_wake, 0 );
+		quit = SDL_AtomicGet( &uart_tx_quit );
+		UartDrain();
+	} while( !quit );
+	return 0;
+}
+
+static void UartWake()
+{
+	if( SDL_AtomicCAS( &uart_tx_wake, 0, 1 ) )
+		SDL_SemPost( uart_tx_sem );
+}
+
+// Queues bytes for the uart thread.  If the FIFO is full, writes it out.
+static void UartPut( const void * data, uint32_t len )
+{
+	const uint8_t * s = data;
+	while( len )
+	{
+		uint32_t head = SDL_AtomicGet( &uart_tx_head );
+		uint32_t used = head - SDL_AtomicGet( &uart_tx_tail );
+		uint32_t n = UART_TX_SIZE - used, ofs = head % UART_TX_SIZE;
+		if( !n )
+		{
+			UartDrain();
+			continue;
+		}
+		if( n > len ) n = len;
+		if( n > UART_TX_SIZE - ofs ) n = UART_TX_SIZE - ofs;
+		memcpy( uart_tx + ofs, s, n );
+		SDL_MemoryBarrierRelease();
+		SDL_AtomicSet( &uart_tx_head, head + n );
+		if( memchr( s, '\n', n ) || used + n >= UART_TX_SIZE / 2 )
+			UartWake();
+		s += n;
+		len -= n;
+	}
+}
+
+// Wakes the uart thread if there's anything for it, the guest is waiting.
+static void UartKick()
+{
+	if( SDL_AtomicGet( &uart_tx_head ) != SDL_AtomicGet( &uart_tx_tail ) )
+		UartWake();
+}
+
+// Emulating a 8250 / 16550 UART
+static uint32_t UartLoad( uint32_t addy )
+{
+	if( addy == 0x10000005 )
+	{
+		uint32_t used = SDL_AtomicGet( &uart_tx_head ) - SDL_AtomicGet( &uart_tx_tail );
+		if( used && ++uart_lsr_polls > 1 )
+		{
+			UartDrain();
+			used = 0;
+		}
+		return ( used < UART_TX_SIZE ? UART_LSR_THRE : 0 ) | ( used ? 0 : UART_LSR_TEMT ) | ( UartRxReady() ? UART_LSR_DR : 0 );
+	}
+	else if( addy == 0x10000000 && UartRxReady() )
+		return UartGet();
+	return MMIOImageLoad( addy );
+}
+
+static uint32_t UartStore( uint32_t addy, uint32_t val )
+{
+	//UART 8250 / 16550 Data Buffer
+	if( addy == 0x10000000 )
+	{
+		uint8_t c = val;
+		UartPut( &c, 1 );
+		uart_lsr_polls = 0;
+		return 0;
+	}
+	return MMIOImageStore( addy, val );
+}
+
+static void SetBackBuffer( int b )
+{
+	SDL_AtomicSet( &framebuffer_back, b );
+	framebuffer_addr = framebuffers[b];
+	framebuffer_dirty_rows = framebuffer_dirty[b];
+	memset( framebuffer_stale, 1, sizeof( framebuffer_stale ) );
+}
+
+// Single buffering, on the cpu thread.  Ready is taken back from scanout
+// first, in case it hasn't picked up the last frame yet, then gets the rows
+// the guest changed and any it missed while scanout had it.  Back's flags
+// are cleared here, so a row drawn after the swap stays flagged and goes
+// up with the next swap, not at the next vblank.
+static void CopyBackBuffer()
+{
+	int b = SDL_AtomicGet( &framebuffer_back ), r, s, y, delta;
+	int pitch = FRAMEBUFFER_X * FRAMEBUFFER_DEPTH;
+	do r = SDL_AtomicGet( &framebuffer_ready );
+	while( !SDL_AtomicCAS( &framebuffer_ready, r, r & ~FRAMEBUFFER_NEW ) );
+	delta = ( r & FRAMEBUFFER_NEW ) ? r & FRAMEBUFFER_DELTA : FRAMEBUFFER_DELTA;
+	r &= FRAMEBUFFER_INDEX;
+	s = 3 - b - r;
+	for( y = 0; y < FRAMEBUFFER_Y; y++ )
+	{
+		if( framebuffer_dirty_rows[y] )
+			framebuffer_stale[r][y] = framebuffer_stale[s][y] = 1;
+		if( !framebuffer_stale[r][y] ) continue;
+		memcpy( framebuffers[r] + y * pitch, framebuffers[b] + y * pitch, pitch );
+		framebuffer_stale[r][y] = 0;
+		framebuffer_dirty[r][y] = 1;
+	}
+	memset( framebuffer_dirty_rows, 0, FRAMEBUFFER_Y );
+	SDL_MemoryBarrierRelease();
+	SDL_AtomicSet( &framebuffer_ready, r | FRAMEBUFFER_NEW | delta );
+}
+
+// Called from the cpu thread, or before it starts.
+static void ResetDisplay()
+{
+	framebuffer_count = 1;
+	SDL_AtomicSet( &framebuffer_mode, FRAMEBUFFER_MODE_RGBA8888 );
+	SDL_AtomicSet( &layer_enable, 0 );
+	SDL_AtomicSet( &surface_addr, 0 );
+	SDL_AtomicSet( &text_cells, 0 );
+	SDL_AtomicSet( &text_cursor, -1 );
+	memset( framebuffer_palette, 0, sizeof( framebuffer_palette ) );
+	SDL_AtomicAdd( &framebuffer_palette_gen, 1 );
+	memset( framebuffer_dirty_rows, 1, FRAMEBUFFER_Y );
+	CopyBackBuffer(); // Show whatever is in there until the guest swaps.
+}
+
+// Headless vblank, on the cpu thread.
+static void CaptureFrame()
+{
+	static uint64_t frame_hash;
+	if( ( UploadFramebuffer() || frame_number == 0 ) && frame_hash_file )
+		frame_hash = HashImage( scanout_image, FRAMEBUFFER_SIZE8 );
+	if( frame_hash_file )
+		fprintf( frame_hash_file, "%u %016llx\n", frame_number, (unsigned long long)frame_hash );
+	if( frame_dump_pattern && frame_number >= frame_dump_first && ( frame_dump_last < 0 || frame_number <= frame_dump_last ) )
+	{
+		char path[1024];
+		snprintf( path, sizeof( path ), frame_dump_pattern, frame_number );
+		FILE * f = fopen( path, "wb" );
+		if( !f )
+			fprintf( stderr, "Warning: can't write frame to \"%s\"\n", path );
+		else
+		{
+			const char * ext = strrchr( path, '.' );
+			int ppm = ext && !strcmp( ext, ".ppm" );
+			int y, x;
+			if( ppm )
+				fprintf( f, "P6\n%d %d\n255\n", FRAMEBUFFER_X, FRAMEBUFFER_Y );
+			for( y = 0; y < FRAMEBUFFER_Y; y++ )
+			{
+				uint8_t row[FRAMEBUFFER_X * 4];
+				uint8_t * o = row;
+				for( x = 0; x < FRAMEBUFFER_X; x++ )
+				{
+					// Pixels are 0xRRGGBBAA words, as SDL_PIXELFORMAT_RGBA8888 wants them.
+					uint32_t p = ((uint32_t *)scanout_image)[y * FRAMEBUFFER_X + x];
+					*(o++) = p >> 24;
+					*(o++) = p >> 16;
+					*(o++) = p >> 8;
+					if( !ppm )
+						*(o++) = p;
+				}
+				fwrite( row, o - row, 1, f );
+			}
+			fclose( f );
+		}
+	}
+	frame_number++;
+}
+
+// Scanline conversion to RGBA8888, n is a multiple of 16.
+static inline uint32_t Expand565( uint32_t p, int bgr )
+{
+	uint32_t r = p >> 11, g = ( p >> 5 ) & 63, b = p & 31;
+	r = ( r << 3 ) | ( r >> 2 );
+	g = ( g << 2 ) | ( g >> 4 );
+	b = ( b << 3 ) | ( b >> 2 );
+	return bgr ? ( b << 24 ) | ( g << 16 ) | ( r << 8 ) | 0xff : ( r << 24 ) | ( g << 16 ) | ( b << 8 ) | 0xff;
+}
+
+#ifdef HOST_SIMD
+static int scanout_avx2 = -1;
+
+// 8 pixels at a time, one per 32 bit lane.
+static inline __m128i Expand565SSE2( __m128i p, int bgr )
+{
+	__m128i r = _mm_srli_epi32( p, 11 );
+	__m128i g = _mm_and_si128( _mm_srli_epi32( p, 5 ), _mm_set1_epi32( 63 ) );
+	__m128i b = _mm_and_si128( p, _mm_set1_epi32( 31 ) );
+	r = _mm_or_si128( _mm_slli_epi32( r, 3 ), _mm_srli_epi32( r, 2 ) );
+	g = _mm_or_si128( _mm_slli_epi32( g, 2 ), _mm_srli_epi32( g, 4 ) );
+	b = _mm_or_si128( _mm_slli_epi32( b, 3 ), _mm_srli_epi32( b, 2 ) );
+	return _mm_or_si128( _mm_or_si128( _mm_slli_epi32( bgr ? b : r, 24 ), _mm_slli_epi32( g, 16 ) ),
+		_mm_or_si128( _mm_slli_epi32( bgr ? r : b, 8 ), _mm_set1_epi32( 0xff ) ) );
+}
+
+__attribute__(( target( "avx2" ) ))
+static void Convert565AVX2( uint32_t * out, const uint16_t * in, int n, int bgr )
+{
+	int i;
+	for( i = 0; i < n; i += 16 )
+	{
+		__m256i v = _mm256_loadu_si256( (const __m256i *)( in + i ) );
+		__m256i lo = _mm256_cvtepu16_epi32( _mm256_castsi256_si128( v ) );
+		__m256i hi = _mm256_cvtepu16_epi32( _mm256_extracti128_si256( v, 1 ) );
+		__m256i parts[2] = { lo, hi };
+		int j;
+		for( j = 0; j < 2; j++ )
+		{
+			__m256i p = parts[j];
+			__m256i r = _mm256_srli_epi32( p, 11 );
+			__m256i g = _mm256_and_si256( _mm256_srli_epi32( p, 5 ), _mm256_set1_epi32( 63 ) );
+			__m256i b = _mm256_and_si256( p, _mm256_set1_epi32( 31 ) );
+			r = _mm256_or_si256( _mm256_slli_epi32( r, 3 ), _mm256_srli_epi32( r, 2 ) );
+			g = _mm256_or_si256( _mm256_slli_epi32( g, 2 ), _mm256_srli_epi32( g, 4 ) );
+			b = _mm256_or_si256( _mm256_slli_epi32( b, 3 ), _mm256_srli_epi32( b, 2 ) );
+			_mm256_storeu_si256( (__m256i *)( out + i + j * 8 ),
+				_mm256_or_si256( _mm256_or_si256( _mm256_slli_epi32( bgr ? b : r, 24 ), _mm256_slli_epi32( g, 16 ) ),
+				_mm256_or_si256( _mm256_slli_epi32( bgr ? r : b, 8 ), _mm256_set1_epi32( 0xff ) ) ) );
+		}
+	}
+}
+
+__attribute__(( target( "avx2" ) ))
+static void ConvertIndexedAVX2( uint32_t * out, const uint8_t * in, int n, const uint32_t * palette )
+{
+	int i;
+	for( i = 0; i < n; i += 8 )
+	{
+		__m256i idx = _mm256_cvtepu8_epi32( _mm_loadl_epi64( (const __m128i *)( in + i ) ) );
+		_mm256_storeu_si256( (__m256i *)( out + i ), _mm256_i32gather_epi32( (const int *)palette, idx, 4 ) );
+	}
+}
+#endif
+
+static void ConvertScanline( uint32_t * out, const uint8_t * in, int n, int mode )
+{
+	int i;
+	switch( mode )
+	{
+	case FRAMEBUFFER_MODE_RGB565:
+	case FRAMEBUFFER_MODE_BGR565:
+	{
+		const uint16_t * in16 = (const uint16_t *)in;
+		int bgr = mode == FRAMEBUFFER_MODE_BGR565;
+#ifdef HOST_SIMD
+		if( scanout_avx2 )
+		{
+			Convert565AVX2( out, in16, n, bgr );
+			break;
+		}
+		for( i = 0; i < n; i += 8 )
+		{
+			__m128i v = _mm_loadu_si128( (const __m128i *)( in16 + i ) );
+			_mm_storeu_si128( (__m128i *)( out + i ), Expand565SSE2( _mm_unpacklo_epi16( v, _mm_setzero_si128() ), bgr ) );
+			_mm_storeu_si128( (__m128i *)( out + i + 4 ), Expand565SSE2( _mm_unpackhi_epi16( v, _mm_setzero_si128() ), bgr ) );
+		}
+#else
+		for( i = 0; i < n; i++ )
+			out[i] = Expand565( in16[i], bgr );
+#endif
+		break;
+	}
+	case FRAMEBUFFER_MODE_INDEXED8:
+#ifdef HOST_SIMD
+		if( scanout_avx2 )
+		{
+			ConvertIndexedAVX2( out, in, n, framebuffer_palette );
+			break;
+		}
+#endif
+		for( i = 0; i < n; i++ )
+			out[i] = framebuffer_palette[in[i]];
+		break;
+	default:
+		memcpy( out, in, n * 4 );
+		break;
+	}
+}
+
+// Host pointer to len bytes of guest RAM at addy, for the layers.
+static const uint8_t * LayerPointer( uint32_t addy, uint32_t len )
+{
+	uint32_t ofs = addy - MINIRV32_RAM_IMAGE_OFFSET;
+	return ( ofs < ram_amt && len <= ram_amt - ofs ) ? ram_image + ofs : 0;
+}
+
+// Draws the tile and sprite layers over one converted scanline.  Builds a
+// line of palette indices per layer first, then merges and expands them 16
+// pixels at a time.
+static void ComposeScanline( uint32_t * out, int y, const uint8_t * sheet, const uint8_t * map, const uint8_t * sprites )
+{
+	uint8_t tiles[FRAMEBUFFER_X], front[FRAMEBUFFER_X], back[FRAMEBUFFER_X], line[FRAMEBUFFER_X];
+	uint32_t rgba[FRAMEBUFFER_X];
+	int x, n;
+
+	memset( tiles, 0, sizeof( tiles ) );
+	memset( front, 0, sizeof( front ) );
+	memset( back, 0, sizeof( back ) );
+	if( map )
+	{
+		for( x = 0; x < TILE_MAP_W; x++ )
+		{
+			uint16_t e;
+			memcpy( &e, map + ( ( y >> 3 ) * TILE_MAP_W + x ) * 2, 2 );
+			const uint8_t * src = sheet + ( e & ( TILE_SHEET_TILES - 1 ) ) * 64 + ( ( e & TILE_VFLIP ) ? 7 - ( y & 7 ) : y & 7 ) * 8;
+			if( e & TILE_HFLIP )
+				for( n = 0; n < 8; n++ )
+					tiles[x * 8 + n] = src[7 - n];
+			else
+				memcpy( tiles + x * 8, src, 8 );
+		}
+	}
+	for( n = sprites ? SPRITE_COUNT - 1 : -1; n >= 0; n-- )
+	{
+		struct Sprite s;
+		memcpy( &s, sprites + n * sizeof( s ), sizeof( s ) );
+		int size = 8 << ( ( s.flags >> SPRITE_SIZE_SHIFT ) & 3 );
+		int r = y - s.y;
+		if( !( s.flags & SPRITE_ENABLE ) || size > 32 || r < 0 || r >= size ) continue;
+		if( s.flags & SPRITE_VFLIP ) r = size - 1 - r;
+		uint8_t * dst = ( s.flags & SPRITE_BEHIND ) ? back : front;
+		int c;
+		for( c = 0; c < size; c++ )
+		{
+			if( (uint32_t)( s.x + c ) >= FRAMEBUFFER_X ) continue;
+			int col = ( s.flags & SPRITE_HFLIP ) ? size - 1 - c : c;
+			uint32_t tile = ( s.tile + ( r >> 3 ) * ( size >> 3 ) + ( col >> 3 ) ) & ( TILE_SHEET_TILES - 1 );
+			uint8_t p = sheet[tile * 64 + ( r & 7 ) * 8 + ( col & 7 )];
+			if( p ) dst[s.x + c] = p;
+		}
+	}
+
+	// Front sprites, then tiles, then sprites behind them.
+#ifdef HOST_SIMD
+	for( x = 0; x < FRAMEBUFFER_X; x += 16 )
+	{
+		__m128i zero = _mm_setzero_si128();
+		__m128i f = _mm_loadu_si128( (const __m128i *)( front + x ) );
+		__m128i t = _mm_loadu_si128( (const __m128i *)( tiles + x ) );
+		__m128i k = _mm_loadu_si128( (const __m128i *)( back + x ) );
+		t = _mm_or_si128( t, _mm_and_si128( _mm_cmpeq_epi8( t, zero ), k ) );
+		_mm_storeu_si128( (__m128i *)( line + x ), _mm_or_si128( f, _mm_and_si128( _mm_cmpeq_epi8( f, zero ), t ) ) );
+	}
+#else
+	for( x = 0; x < FRAMEBUFFER_X; x++ )
+		line[x] = front[x] ? front[x] : tiles[x] ? tiles[x] : back[x];
+#endif
+	ConvertScanline( rgba, line, FRAMEBUFFER_X, FRAMEBUFFER_MODE_INDEXED8 );
+#ifdef HOST_SIMD
+	for( x = 0; x < FRAMEBUFFER_X; x += 16 )
+	{
+		// Keep the bitmap where the index is 0.
+		__m128i m = _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i *)( line + x ) ), _mm_setzero_si128() );
+		__m128i m16[2] = { _mm_unpacklo_epi8( m, m ), _mm_unpackhi_epi8( m, m ) };
+		int q;
+		for( q = 0; q < 4; q++ )
+		{
+			__m128i m32 = ( q & 1 ) ? _mm_unpackhi_epi16( m16[q >> 1], m16[q >> 1] ) : _mm_unpacklo_epi16( m16[q >> 1], m16[q >> 1] );
+			__m128i o = _mm_loadu_si128( (const __m128i *)( out + x + q * 4 ) );
+			__m128i l = _mm_loadu_si128( (const __m128i *)( rgba + x + q * 4 ) );
+			_mm_storeu_si128( (__m128i *)( out + x + q * 4 ), _mm_or_si128( _mm_and_si128( m32, o ), _mm_andnot_si128( m32, l ) ) );
+		}
+	}
+#else
+	for( x = 0; x < FRAMEBUFFER_X; x++ )
+		if( line[x] ) out[x] = rgba[x];
+#endif
+}
+
+// v modulo n, in 0 to n - 1 for negative v too.
+static uint32_t SurfaceWrap( int64_t v, uint32_t n )
+{
+	return ( ( v % n ) + n ) % n;
+}
+
+// Gathers the visible part of surface row y into row, wrapping around.
+static void SurfaceRow( uint8_t * row, const uint8_t * surface, uint32_t width, uint32_t height, int bytes, const uint8_t * line_scroll, int y )
+{
+	int32_t dx = 0;
+	if( line_scroll )
+		memcpy( &dx, line_scroll + y * 4, 4 );
+	const uint8_t * src = surface + (uint64_t)SurfaceWrap( (int64_t)SDL_AtomicGet( &surface_scroll_y ) + y, height ) * width * bytes;
+	uint32_t x = SurfaceWrap( (int64_t)SDL_AtomicGet( &surface_scroll_x ) + dx, width );
+	int done = 0;
+	while( done < FRAMEBUFFER_X )
+	{
+		int n = width - x;
+		if( n > FRAMEBUFFER_X - done ) n = FRAMEBUFFER_X - done;
+		memcpy( row + done * bytes, src + x * bytes, n * bytes );
+		done += n;
+		x = 0;
+	}
+}
+
+// Draws text row y over one converted scanline.  blink is nonzero in the
+// half of the blink period that blinking cells and the cursor are hidden.
+static void ComposeText( uint32_t * out, int y, const uint8_t * cells, uint32_t cursor, int blink )
+{
+	const uint8_t * cell = cells + ( y >> 3 ) * TEXT_W * 2;
+	int line = y & 7, cx, x;
+	for( cx = 0; cx < TEXT_W; cx++, cell += 2, out += 8 )
+	{
+		uint8_t ch = cell[0], attr = cell[1];
+		uint32_t fg = text_colors[attr & 0xf];
+		int bg = ( attr >> 4 ) & 7;
+		int bits = ( ch >= 0x20 && ch < 0x80 && !( blink && ( attr & TEXT_ATTR_BLINK ) ) ) ? text_font[ch - 0x20][line] : 0;
+		if( line >= 6 && !blink && cursor == ( y >> 3 ) * TEXT_W + cx )
+			bits = 0xff;
+		if( bg )
+			for( x = 0; x < 8; x++ )
+				out[x] = ( bits >> x & 1 ) ? fg : text_colors[bg];
+		else
+			for( x = 0; x < 8; x++ )
+				if( bits >> x & 1 ) out[x] = fg;
+	}
+}
+
+// Scanout, called at vblank on the render thread, or on the cpu thread when
+// headless.  Picks up the last frame the guest swapped in, then converts the
+// rows that changed since that buffer was last uploaded, all of them if the
+// texture holds a different buffer (other than the frame before a single
+// buffered swap), mode or palette.  Returns nonzero if the texture changed.
+static int UploadFramebuffer()
+{
+	uint8_t * dirty;
+	int b, c = 0, c0, uploaded = 0;
+
+	// The layers, the surface and text are in guest RAM, which isn't
+	// tracked, so while any of them is on every vblank does the whole frame
+	// again.
+	int layers = SDL_AtomicGet( &layer_enable );
+	const uint8_t * sheet = LayerPointer( SDL_AtomicGet( &layer_tile_sheet ), TILE_SHEET_TILES * 64 );
+	const uint8_t * map = ( layers & LAYER_TILES ) ? LayerPointer( SDL_AtomicGet( &layer_tile_map ), TILE_MAP_W * TILE_MAP_H * 2 ) : 0;
+	const uint8_t * sprites = ( layers & LAYER_SPRITES ) ? LayerPointer( SDL_AtomicGet( &layer_sprites ), SPRITE_COUNT * sizeof( struct Sprite ) ) : 0;
+	layers = sheet && ( map || sprites );
+
+	int mode = SDL_AtomicGet( &framebuffer_mode );
+	uint32_t surface_w = SDL_AtomicGet( &surface_width ), surface_h = SDL_AtomicGet( &surface_height );
+	const uint8_t * surface = ( surface_w && surface_h && (uint64_t)surface_w * surface_h * framebuffer_mode_bytes[mode] <= ram_amt ) ?
+		LayerPointer( SDL_AtomicGet( &surface_addr ), surface_w * surface_h * framebuffer_mode_bytes[mode] ) : 0;
+	const uint8_t * line_scroll = surface ? LayerPointer( SDL_AtomicGet( &surface_line_scroll ), FRAMEBUFFER_Y * 4 ) : 0;
+	const uint8_t * text = LayerPointer( SDL_AtomicGet( &text_cells ), TEXT_W * TEXT_H * 2 );
+	uint32_t cursor = SDL_AtomicGet( &text_cursor );
+	int blink = text ? ( text_frame++ / TEXT_BLINK ) & 1 : 0;
+	int untracked = layers || surface || text;
+	if( untracked || framebuffer_shown_untracked )
+		framebuffer_pending = 1;
+
+	// Nothing changes on screen without a swap, only what the layers,
+	// the surface or text read from RAM.
+	if( SDL_AtomicGet( &framebuffer_ready ) & FRAMEBUFFER_NEW )
+	{
+		int r = SDL_AtomicSet( &framebuffer_ready, framebuffer_scanout );
+		SDL_MemoryBarrierAcquire();
+		framebuffer_delta = ( r & FRAMEBUFFER_DELTA ) ? framebuffer_scanout : -1;
+		framebuffer_scanout = r & FRAMEBUFFER_INDEX;
+		framebuffer_pending = 1;
+	}
+	if( !framebuffer_pending ) return 0;
+	b = framebuffer_scanout;
+	dirty = framebuffer_dirty[b];
+	framebuffer_pending = 0;
+
+	// A dirty flag covers one RGBA8888 scanline worth of bytes, that's
+	// more than one scanline in the smaller modes.
+	int palette = SDL_AtomicGet( &framebuffer_palette_gen );
+	int pitch8 = FRAMEBUFFER_X * framebuffer_mode_bytes[mode];
+	int rows_per_flag = FRAMEBUFFER_X * FRAMEBUFFER_DEPTH / pitch8;
+	int flags = FRAMEBUFFER_Y / rows_per_flag;
+	if( ( b != framebuffer_shown && ( framebuffer_shown < 0 || framebuffer_shown != framebuffer_delta ) ) || mode != framebuffer_shown_mode || untracked || framebuffer_shown_untracked || palette != framebuffer_shown_palette )
+		memset( dirty, 1, flags );
+#ifdef HOST_SIMD
+	if( scanout_avx2 < 0 )
+		scanout_avx2 = __builtin_cpu_supports( "avx2" );
+#endif
+	while( c < flags )
+	{
+		if( !dirty[c] ) { c++; continue; }
+		for( c0 = c; c < flags && dirty[c]; c++ );
+		int y0 = c0 * rows_per_flag, y = c * rows_per_flag;
+
+		SDL_Rect rect = { 0, y0, FRAMEBUFFER_X, y - y0 };
+		void * pixels;
+		int pitch, row;
+		if( headless )
+		{
+			pixels = scanout_image + y0 * FRAMEBUFFER_X * FRAMEBUFFER_DEPTH;
+			pitch = FRAMEBUFFER_X * FRAMEBUFFER_DEPTH;
+		}
+		else if( SDL_LockTexture( texture, &rect, &pixels, &pitch ) )
+		{
+			// Try again next vblank.
+			framebuffer_pending = 1;
+			framebuffer_shown = -1;
+			return uploaded;
+		}
+		for( row = y0; row < y; row++ )
+		{
+			uint32_t * out = (uint32_t *)( (uint8_t *)pixels + ( row - y0 ) * pitch );
+			uint8_t window[FRAMEBUFFER_X * FRAMEBUFFER_DEPTH];
+			if( surface )
+				SurfaceRow( window, surface, surface_w, surface_h, framebuffer_mode_bytes[mode], line_scroll, row );
+			ConvertScanline( out, surface ? window : framebuffers[b] + row * pitch8, FRAMEBUFFER_X, mode );
+			if( layers )
+				ComposeScanline( out, row, sheet, map, sprites );
+			if( text )
+				ComposeText( out, row, text, cursor, blink );
+		}
+		if( !headless )
+			SDL_UnlockTexture( texture );
+		memset( dirty + c0, 0, c - c0 );
+		uploaded = 1;
+	}
+	framebuffer_shown = b;
+	framebuffer_shown_mode = mode;
+	framebuffer_shown_palette = palette;
+	framebuffer_shown_untracked = untracked;
+	return uploaded;
+}
+
+static uint32_t DisplayLoad( uint32_t addy )
+{
+	//framebuffer vblank, set by the render thread, cleared on read.
+	if ( addy == 0x10038000 )
+		return SDL_AtomicSet( &framebuffer_vblank, 0 );
+	else if( addy == 0x10038008 )
+		return framebuffer_count;
+	else if( addy == 0x1003800c )
+		return SDL_AtomicGet( &framebuffer_back );
+	else if( addy == 0x10038010 )
+		return SDL_AtomicGet( &framebuffer_mode );
+	else if( addy == 0x10038020 )
+		return SDL_AtomicGet( &layer_enable );
+	else if( addy == 0x10038024 )
+		return SDL_AtomicGet( &layer_tile_sheet );
+	else if( addy == 0x10038028 )
+		return SDL_AtomicGet( &layer_tile_map );
+	else if( addy == 0x1003802c )
+		return SDL_AtomicGet( &layer_sprites );
+	else if( addy == 0x10038030 )
+		return SDL_AtomicGet( &surface_addr );
+	else if( addy == 0x10038034 )
+		return SDL_AtomicGet( &surface_width );
+	else if( addy == 0x10038038 )
+		return SDL_AtomicGet( &surface_height );
+	else if( addy == 0x1003803c )
+		return SDL_AtomicGet( &surface_scroll_x );
+	else if( addy == 0x10038040 )
+		return SDL_AtomicGet( &surface_scroll_y );
+	else if( addy == 0x10038044 )
+		return SDL_AtomicGet( &surface_line_scroll );
+	else if( addy == 0x10038048 )
+		return SDL_AtomicGet( &text_cells );
+	else if( addy == 0x1003804c )
+		return SDL_AtomicGet( &text_cursor );
+	else if( addy - FRAMEBUFFER_PALETTE < sizeof( framebuffer_palette ) )
+		return framebuffer_palette[( addy - FRAMEBUFFER_PALETTE ) >> 2];
+	return MMIOImageLoad( addy );
+}
+
+static uint32_t DisplayStore( uint32_t addy, uint32_t val )
+{
+	//frame buffer swap.  With one buffer, copy the rows that changed to
+	//ready, with multiple buffering trade the finished frame for it.
+	if( addy == 0x10038004 ) {
+		if( framebuffer_count == 1 )
+			CopyBackBuffer();
+		else
+		{
+			SDL_MemoryBarrierRelease();
+			SetBackBuffer( SDL_AtomicSet( &framebuffer_ready, SDL_AtomicGet( &framebuffer_back ) | FRAMEBUFFER_NEW ) & FRAMEBUFFER_INDEX );
+		}
+		return 0;
+	}
+	//number of framebuffers, 1 to FRAMEBUFFER_COUNT.  Anything above 1 is triple buffering.
+	else if( addy == 0x10038008 ) {
+		framebuffer_count = ( val < 1 ) ? 1 : ( val > FRAMEBUFFER_COUNT ) ? FRAMEBUFFER_COUNT : val;
+		return 0;
+	}
+	//pixel format, FRAMEBUFFER_MODE_*
+	else if( addy == 0x10038010 ) {
+		if( val <= FRAMEBUFFER_MODE_INDEXED8 )
+			SDL_AtomicSet( &framebuffer_mode, val );
+		return 0;
+	}
+	//tile and sprite layers, LAYER_*, then where their tables are in RAM.
+	else if( addy == 0x10038020 ) {
+		SDL_AtomicSet( &layer_enable, val );
+		return 0;
+	}
+	else if( addy == 0x10038024 ) {
+		SDL_AtomicSet( &layer_tile_sheet, val );
+		return 0;
+	}
+	else if( addy == 0x10038028 ) {
+		SDL_AtomicSet( &layer_tile_map, val );
+		return 0;
+	}
+	else if( addy == 0x1003802c ) {
+		SDL_AtomicSet( &layer_sprites, val );
+		return 0;
+	}
+	//virtual surface: address, width, height, scroll x, scroll y, line scroll table.
+	else if( addy >= 0x10038030 && addy <= 0x10038044 ) {
+		SDL_atomic_t * surface_regs[] = { &surface_addr, &surface_width, &surface_height, &surface_scroll_x, &surface_scroll_y, &surface_line_scroll };
+		SDL_AtomicSet( surface_regs[( addy - 0x10038030 ) >> 2], val );
+		return 0;
+	}
+	//text mode, the cell array in RAM, then the cursor cell.
+	else if( addy == 0x10038048 ) {
+		SDL_AtomicSet( &text_cells, val );
+		return 0;
+	}
+	else if( addy == 0x1003804c ) {
+		SDL_AtomicSet( &text_cursor, val );
+		return 0;
+	}
+	else if( addy - FRAMEBUFFER_PALETTE < sizeof( framebuffer_palette ) ) {
+		framebuffer_palette[( addy - FRAMEBUFFER_PALETTE ) >> 2] = val;
+		SDL_AtomicAdd( &framebuffer_palette_gen, 1 );
+		return 0;
+	}
+	return MMIOImageStore( addy, val );
+}
+
+// Host pointer for a blitter rectangle, if all of it is in RAM or the back
+// buffer.  Stores there have to keep the decode cache and dirty rows right.
+static uint8_t * BlitPointer( uint32_t addy, uint32_t pitch, uint32_t row_bytes, uint32_t height, int * in_framebuffer )
+{
+	uint64_t span = (uint64_t)pitch * ( height - 1 ) + row_bytes;
+	if( addy - MINIRV32_RAM_IMAGE_OFFSET < ram_amt && span <= ram_amt - ( addy - MINIRV32_RAM_IMAGE_OFFSET ) )
+	{
+		*in_framebuffer = 0;
+		return ram_image + ( addy - MINIRV32_RAM_IMAGE_OFFSET );
+	}
+	// All of the buffer, even the tail the display registers hide from the core.
+	if( addy - FRAMEBUFFER_BASE < FRAMEBUFFER_SIZE8 && span <= FRAMEBUFFER_SIZE8 - ( addy - FRAMEBUFFER_BASE ) )
+	{
+		*in_framebuffer = 1;
+		return framebuffer_addr + ( addy - FRAMEBUFFER_BASE );
+	}
+	return 0;
+}
+
+static void BlitTouched( uint8_t * p, uint32_t len, int in_framebuffer )
+{
+	if( in_framebuffer )
+	{
+		uint32_t ofs = p - framebuffer_addr;
+		memset( framebuffer_dirty_rows + ( ofs >> 10 ), 1, ( ( ofs + len - 1 ) >> 10 ) - ( ofs >> 10 ) + 1 );
+	}
+	else
+	{
+		uint32_t ofs = p - ram_image, w;
+		for( w = ofs & ~3; w < ofs + len; w += 4 )
+		{
+			if( !dcache->code_pages[ w >> MINIRV32_CODE_PAGE_SHIFT ] )
+				w |= ( 1 << MINIRV32_CODE_PAGE_SHIFT ) - 4; // Skip the rest of the page.
+			else
+				MiniRV32IMAInvalidateCode( dcache, w );
+		}
+	}
+}
+
+// One row of each op, bytes is the row length, bpp_shift log2 of the pixel size.
+static void BlitFillRow( uint8_t * dst, uint32_t bytes, uint32_t color, int bpp_shift )
+{
+	uint32_t i = 0;
+	// Replicate the color over 32 bits.
+	if( bpp_shift == 0 ) color = ( color & 0xff ) * 0x01010101;
+	else if( bpp_shift == 1 ) color = ( color & 0xffff ) * 0x00010001;
+#ifdef HOST_SIMD
+	__m128i c = _mm_set1_epi32( color );
+	for( ; i + 16 <= bytes; i += 16 )
+		_mm_storeu_si128( (__m128i *)( dst + i ), c );
+#endif
+	for( ; i + 4 <= bytes; i += 4 )
+		memcpy( dst + i, &color, 4 );
+	for( ; i < bytes; i++ )
+		dst[i] = color >> ( ( i & 3 ) * 8 );
+}
+
+static void BlitKeyedRow( uint8_t * dst, const uint8_t * src, uint32_t bytes, uint32_t key, int bpp_shift )
+{
+	uint32_t i = 0;
+#ifdef HOST_SIMD
+	__m128i k = bpp_shift == 0 ? _mm_set1_epi8( key ) : bpp_shift == 1 ? _mm_set1_epi16( key ) : _mm_set1_epi32( key );
+	for( ; i + 16 <= bytes; i += 16 )
+	{
+		__m128i s = _mm_loadu_si128( (const __m128i *)( src + i ) );
+		__m128i d = _mm_loadu_si128( (const __m128i *)( dst + i ) );
+		__m128i m = bpp_shift == 0 ? _mm_cmpeq_epi8( s, k ) : bpp_shift == 1 ? _mm_cmpeq_epi16( s, k ) : _mm_cmpeq_epi32( s, k );
+		_mm_storeu_si128( (__m128i *)( dst + i ), _mm_or_si128( _mm_and_si128( m, d ), _mm_andnot_si128( m, s ) ) );
+	}
+#endif
+	for( ; i < bytes; i += 1 << bpp_shift )
+	{
+		uint32_t p = 0;
+		memcpy( &p, src + i, 1 << bpp_shift );
+		if( p != ( key & ( 0xffffffff >> ( 32 - ( 8 << bpp_shift ) ) ) ) )
+			memcpy( dst + i, src + i, 1 << bpp_shift );
+	}
+}
+
+// out = ( src * a + dst * ( 255 - a ) ) / 255 per channel, a is the low byte of the source pixel.
+static inline uint32_t BlendChannel( uint32_t s, uint32_t d, uint32_t a )
+{
+	uint32_t x = s * a + d * ( 255 - a ) + 128;
+	return ( x + ( x >> 8 ) ) >> 8;
+}
+
+static void BlitBlendRow( uint8_t * dst, const uint8_t * src, uint32_t bytes )
+{
+	uint32_t i = 0;
+#ifdef HOST_SIMD
+	__m128i zero = _mm_setzero_si128(), c255 = _mm_set1_epi16( 255 ), c128 = _mm_set1_epi16( 128 );
+	for( ; i + 16 <= bytes; i += 16 )
+	{
+		__m128i s = _mm_loadu_si128( (const __m128i *)( src + i ) );
+		__m128i d = _mm_loadu_si128( (const __m128i *)( dst + i ) );
+		__m128i halves[2];
+		int h;
+		for( h = 0; h < 2; h++ )
+		{
+			__m128i s16 = h ? _mm_unpackhi_epi8( s, zero ) : _mm_unpacklo_epi8( s, zero );
+			__m128i d16 = h ? _mm_unpackhi_epi8( d, zero ) : _mm_unpacklo_epi8( d, zero );
+			__m128i a = _mm_shufflehi_epi16( _mm_shufflelo_epi16( s16, 0 ), 0 );
+			__m128i x = _mm_add_epi16( _mm_add_epi16( _mm_mullo_epi16( s16, a ), _mm_mullo_epi16( d16, _mm_sub_epi16( c255, a ) ) ), c128 );
+			halves[h] = _mm_srli_epi16( _mm_add_epi16( x, _mm_srli_epi16( x, 8 ) ), 8 );
+		}
+		_mm_storeu_si128( (__m128i *)( dst + i ), _mm_packus_epi16( halves[0], halves[1] ) );
+	}
+#endif
+	for( ; i + 4 <= bytes; i += 4 )
+	{
+		uint32_t a = src[i], c;
+		for( c = 0; c < 4; c++ )
+			dst[i + c] = BlendChannel( src[i + c], dst[i + c], a );
+	}
+}
+
+// The keyed and blended rows read 16 bytes of source ahead of writing them,
+// so a row that overlaps its own destination goes through a buffer a piece
+// at a time instead, back to front if the destination is further on, like
+// memmove.
+static void BlitOverlappingRow( uint32_t op, uint8_t * dst, const uint8_t * src, uint32_t bytes, uint32_t key, int bpp_shift )
+{
+	uint8_t staged[1024];
+	uint32_t done, n;
+	for( done = 0; done < bytes; done += n )
+	{
+		n = ( bytes - done < sizeof( staged ) ) ? bytes - done : sizeof( staged );
+		uint32_t i = ( dst > src ) ? bytes - done - n : done;
+		memcpy( staged, src + i, n );
+		if( op == BLIT_OP_COPY_KEYED )
+			BlitKeyedRow( dst + i, staged, n, key, bpp_shift );
+		else
+			BlitBlendRow( dst + i, staged, n );
+	}
+}
+
+static uint32_t Blit( uint32_t control )
+{
+	uint32_t op = control & 0xff;
+	int bpp_shift = 2 - ( ( control >> BLIT_BPP_SHIFT ) & 3 );
+	uint32_t width = blit_regs[BLIT_WIDTH >> 2], height = blit_regs[BLIT_HEIGHT >> 2];
+	uint32_t row_bytes = width << bpp_shift;
+	uint32_t src_pitch = blit_regs[BLIT_SRC_PITCH >> 2], dst_pitch = blit_regs[BLIT_DST_PITCH >> 2];
+	int src_fb = 0, dst_fb = 0;
+	uint8_t * src = 0, * dst;
+	uint32_t y;
+
+	if( !width || !height || width > FRAMEBUFFER_SIZE8 || bpp_shift < 0 || op < BLIT_OP_FILL || op > BLIT_OP_BLEND || ( op == BLIT_OP_BLEND && bpp_shift != 2 ) )
+		return BLIT_STATUS_DONE | BLIT_STATUS_ERROR;
+	dst = BlitPointer( blit_regs[BLIT_DST >> 2], dst_pitch, row_bytes, height, &dst_fb );
+	if( op != BLIT_OP_FILL )
+		src = BlitPointer( blit_regs[BLIT_SRC >> 2], src_pitch, row_bytes, height, &src_fb );
+	if( !dst || ( op != BLIT_OP_FILL && !src ) )
+		return BLIT_STATUS_DONE | BLIT_STATUS_ERROR;
+
+	for( y = 0; y < height; y++ )
+	{
+		// Go bottom up if the source is above an overlapping destination.
+		uint32_t row = ( src && src_fb == dst_fb && dst > src ) ? height - 1 - y : y;
+		uint8_t * d = dst + (uint64_t)row * dst_pitch;
+		const uint8_t * s = src ? src + (uint64_t)row * src_pitch : 0;
+		if( op != BLIT_OP_FILL && op != BLIT_OP_COPY && src_fb == dst_fb && s != d && s < d + row_bytes && d < s + row_bytes )
+			BlitOverlappingRow( op, d, s, row_bytes, blit_regs[BLIT_COLOR >> 2], bpp_shift );
+		else switch( op )
+		{
+			case BLIT_OP_FILL: BlitFillRow( d, row_bytes, blit_regs[BLIT_COLOR >> 2], bpp_shift ); break;
+			case BLIT_OP_COPY: memmove( d, s, row_bytes ); break;
+			case BLIT_OP_COPY_KEYED: BlitKeyedRow( d, s, row_bytes, blit_regs[BLIT_COLOR >> 2], bpp_shift ); break;
+			case BLIT_OP_BLEND: BlitBlendRow( d, s, row_bytes ); break;
+		}
+		BlitTouched( d, row_bytes, dst_fb );
+	}
+	return BLIT_STATUS_DONE;
+}
+
+static uint32_t BlitLoad( uint32_t addy )
+{
+	uint32_t reg = addy - BLIT_BASE;
+	if( reg == BLIT_STATUS )
+	{
+		uint32_t status = blit_status;
+		blit_status = 0;
+		return status;
+	}
+	else if( reg < BLIT_STATUS )
+		return blit_regs[reg >> 2];
+	return 0;
+}
+
+static uint32_t BlitStore( uint32_t addy, uint32_t val )
+{
+	uint32_t reg = addy - BLIT_BASE;
+	if( reg < BLIT_STATUS )
+		blit_regs[reg >> 2] = val;
+	if( reg == BLIT_CONTROL )
+		blit_status = Blit( val );
+	return 0;
+}
+
+// CLNT, https://chromitem-soc.readthedocs.io/en/latest/clint.html
+static uint32_t ClintLoad( uint32_t addy )
+{
+	if( addy == 0x1100bffc )
+		return core->timerh;
+	else if( addy == 0x1100bff8 )
+		return core->timerl;
+	return 0;
+}
+
+static uint32_t ClintStore( uint32_t addy, uint32_t val )
+{
+	if ( addy == 0x11004004 )
+		core->timermatchh = val;
+	else if ( addy == 0x11004000 )
+		core->timermatchl = val;
+	return 0;
+}
+
+// SYSCON (reboot, poweroff, etc.)
+static uint32_t SysconStore( uint32_t addy, uint32_t val )
+{
+	if( addy == 0x11100000 && val == SYSCON_SNAPSHOT ) {
+		// Without -S there's nowhere to put it, carry on.
+		if( snapshot_file ) SDL_AtomicSet( &snapshot_request, 1 );
+		return 0;
+	}
+	if ( addy == 0x11100000 ) {
+		core->pc = core->pc + 4;
+		return val;
+	}
+	return 0;
+}
+
+static uint32_t PendingInterrupts()
+{
+	return ( SDL_AtomicGet( &framebuffer_vblank ) ? IRQ_VBLANK : 0 ) | ( ( blit_status & BLIT_STATUS_DONE ) ? IRQ_BLIT : 0 ) |
+		( UartRxReady() ? IRQ_UART : 0 );
+}
+
+static uint32_t InterruptLoad( uint32_t addy )
+{
+	if( addy == 0x11200000 )
+		return PendingInterrupts();
+	else if( addy == 0x11200004 )
+		return irq_enable;
+	return 0;
+}
+
+static uint32_t InterruptStore( uint32_t addy, uint32_t val )
+{
+	if( addy == 0x11200004 )
+		irq_enable = val;
+	return 0;
+}
+
+// The framebuffer itself isn't a device, the core maps it straight to framebuffer_addr (MINIRV32_HOSTMEM_*).
+static int RegisterDevices()
+{
+	mmio_devices[0].load = MMIOIgnoreLoad;
+	mmio_devices[0].store = MMIOIgnoreStore;
+	return RegisterMMIO( 0x10000000, 0x100, UartLoad, UartStore ) ||
+		RegisterMMIO( 0x10038000, 0x800, DisplayLoad, DisplayStore ) ||
+		RegisterMMIO( BLIT_BASE, 0x100, BlitLoad, BlitStore ) ||
+		RegisterMMIO( 0x11000000, 0x10000, ClintLoad, ClintStore ) ||
+		RegisterMMIO( 0x11100000, 0x1000, 0, SysconStore ) ||
+		RegisterMMIO( 0x11200000, 0x100, InterruptLoad, InterruptStore );
+}
+
+// Only called for addresses in MINIRV32_MMIO_RANGE.
+static uint32_t HandleControlStore( uint32_t addy, uint32_t val )
+{
+	return mmio_devices[ mmio_map[ ( addy - MMIO_BASE ) >> MMIO_GRANULE_SHIFT ] ].store( addy, val );
+}
+
+static uint32_t HandleControlLoad( uint32_t addy )
+{
+	return mmio_devices[ mmio_map[ ( addy - MMIO_BASE ) >> MMIO_GRANULE_SHIFT ] ].load( addy );
+}
+
 static void HandleOtherCSRWrite( uint8_t * image, uint16_t csrno, uint32_t value )
 {
+	char num[12];
 	if( csrno == 0x136 )
 	{
-		printf( "%d", value ); fflush( stdout );
+		UartPut( num, snprintf( num, sizeof( num ), "%d", value ) );
 	}
 	if( csrno == 0x137 )
 	{
-		printf( "%08x", value ); fflush( stdout );
+		UartPut( num, snprintf( num, sizeof( num ), "%08x", value ) );
 	}
 	else if( csrno == 0x138 )
 	{
@@ -521,11 +2738,12 @@ static void HandleOtherCSRWrite( uint8_t * image, uint16_t csrno, uint32_t value
 			ptrend++;
 		}
 		if( ptrend != ptrstart )
-			fwrite( image + ptrstart, ptrend - ptrstart, 1, stdout );
+			UartPut( image + ptrstart, ptrend - ptrstart );
 	}
 	else if( csrno == 0x139 )
 	{
-		putchar( value ); fflush( stdout );
+		uint8_t c = value;
+		UartPut( &c, 1 );
 	}
 }
 
@@ -533,8 +2751,7 @@ static int32_t HandleOtherCSRRead( uint8_t * image, uint16_t csrno )
 {
 	if( csrno == 0x140 )
 	{
-		if( !IsKBHit() ) return -1;
-		return ReadKBByte();
+		return UartGet();
 	}
 	return 0;
 }
@@ -545,7 +2762,11 @@ static void DumpState( struct MiniRV32IMAState * core, uint8_t * ram_image )
 	uint32_t pc_offset = pc - MINIRV32_RAM_IMAGE_OFFSET;
 	uint32_t ir = 0;
 
+	uint32_t sym_ofs;
+	const char * sym = SymbolAt( pc, &sym_ofs );
 	printf( "PC: %08x ", pc );
+	if( sym )
+		printf( "<%s+0x%x> ", sym, sym_ofs );
 	if( pc_offset >= 0 && pc_offset < ram_amt - 3 )
 	{
 		ir = *((uint32_t*)(&((uint8_t*)ram_image)[pc_offset]));
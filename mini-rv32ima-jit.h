@@ -0,0 +1,559 @@
+// You may use this file or any portions herein under any of the BSD, MIT, or CC0 licenses.
+
+#ifndef _MINI_RV32IMA_JIT_H
+#define _MINI_RV32IMA_JIT_H
+
+/**
+	Optional x86-64 dynamic binary translator for mini-rv32ima.h.
+
+	Include it after mini-rv32ima.h, with MINIRV32_DECODE_CACHE defined.
+
+	MiniRV32IMAStepJit takes the same arguments and returns the same codes
+	as MiniRV32IMAStep.  Guest basic blocks are translated to host code the
+	first time they run, and blocks that end in a direct jump or branch get
+	chained together.  CSR, SYSTEM, atomics, illegal instructions and any
+	load or store that misses both RAM and the MINIRV32_HOSTMEM window fall back to MiniRV32IMAStepCached one
+	instruction at a time.  So do stores landing on a page with code on it,
+	which is how self-modifying code gets noticed.  MINIRV32_POSTEXEC only
+	runs for the instructions that fall back.
+
+	Budget: no more than count instructions are retired per call, and
+	cyclel/cycleh count every one of them.  A block that does not fit in
+	what is left of the budget is not entered, the rest of the slice goes
+	through the interpreter instead.
+
+	MiniRV32IMAJitTranslateAt translates a block ahead of time.  Hosts can
+	save the pc of every block with code in jit->blocks and translate them
+	again up front the next time the same image is loaded.
+
+	Generated code works on struct MiniRV32IMAState directly, so it can't
+	be combined with MINIRV32_CUSTOM_INTERNALS.  Only available on x86-64
+	hosts with the System V ABI, check MINIRV32_JIT_AVAILABLE.
+*/
+
+#if defined( __x86_64__ ) && !defined( _WIN32 )
+
+#define MINIRV32_JIT_AVAILABLE
+
+#ifndef MINIRV32_JIT_CODE_SIZE
+	#define MINIRV32_JIT_CODE_SIZE (16*1024*1024)
+#endif
+
+#ifndef MINIRV32_JIT_BLOCK_BITS
+	#define MINIRV32_JIT_BLOCK_BITS 16
+#endif
+
+#ifndef MINIRV32_JIT_MAX_BLOCK
+	#define MINIRV32_JIT_MAX_BLOCK 32 // Guest instructions
+#endif
+
+#define MINIRV32_JIT_BLOCKS (1<<MINIRV32_JIT_BLOCK_BITS)
+#define MINIRV32_JIT_BLOCK_MAX_BYTES ( MINIRV32_JIT_MAX_BLOCK * 192 + 256 )
+
+// Why generated code handed control back.
+#define MINIRV32_JIT_EXIT_NEXT 0      // Continue at state->pc.
+#define MINIRV32_JIT_EXIT_INTERPRET 1 // Run the instruction at state->pc through the interpreter.
+#define MINIRV32_JIT_EXIT_BUDGET 2    // Block at state->pc is longer than what is left of the budget.
+
+struct MiniRV32IMAJitBlock
+{
+	uint32_t pc;
+	uint8_t * code; // 0 if the first instruction can't be translated.
+};
+
+struct MiniRV32IMAJit
+{
+	// Shared with generated code, see MiniRV32IMAJitEmitTrampoline.
+	int64_t budget;
+	uint8_t * link;      // Patchable jump the last block exited through, or 0.
+	uint32_t exit_reason;
+	uint8_t * code_pages;
+
+	struct MiniRV32IMADecodeCache * dcache;
+	uint32_t generation;  // dcache->generation the translations are valid for.
+	uint32_t flushes;
+	uint8_t * code;
+	uint32_t code_used;
+	uint32_t code_start;  // First byte after the trampoline.
+	void (*enter)( struct MiniRV32IMAState * state, uint8_t * image, struct MiniRV32IMAJit * jit, uint8_t * code );
+	uint8_t * exit;
+	struct MiniRV32IMAJitBlock blocks[MINIRV32_JIT_BLOCKS];
+};
+
+MINIRV32_DECORATE struct MiniRV32IMAJit * MiniRV32IMAJitCreate( struct MiniRV32IMADecodeCache * dcache );
+MINIRV32_DECORATE void MiniRV32IMAJitFlush( struct MiniRV32IMAJit * jit );
+MINIRV32_DECORATE int MiniRV32IMAJitTranslateAt( struct MiniRV32IMAJit * jit, uint8_t * image, uint32_t pc );
+MINIRV32_DECORATE int32_t MiniRV32IMAStepJit( struct MiniRV32IMAState * state, uint8_t * image, uint32_t vProcAddress, uint32_t elapsedUs, int count, struct MiniRV32IMAJit * jit );
+
+#ifdef MINIRV32_IMPLEMENTATION
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+#define JIT_B( x ) { *e++ = (uint8_t)(x); }
+#define JIT_D( x ) { uint32_t v_ = (uint32_t)(x); memcpy( e, &v_, 4 ); e += 4; }
+#define JIT_Q( x ) { uint64_t v_ = (uint64_t)(x); memcpy( e, &v_, 8 ); e += 8; }
+#define JIT_PATCH_REL32( at, target ) { int32_t r_ = (int32_t)( (uint8_t*)(target) - ( (uint8_t*)(at) + 4 ) ); memcpy( (at), &r_, 4 ); }
+
+// Host registers.  rbx = state, rbp = jit, r12 = image, r13 = budget, r14 = code_pages.
+#define JIT_EAX 0
+#define JIT_ECX 1
+#define JIT_EDX 2
+
+#define JIT_OFS_PC    offsetof( struct MiniRV32IMAState, pc )
+#define JIT_OFS_CYCLE offsetof( struct MiniRV32IMAState, cyclel )
+
+// Same semantics as the reference core, called from generated code.
+static uint32_t MiniRV32IMAJitDiv( uint32_t rs1, uint32_t rs2 ) { return ( rs2 == 0 ) ? 0xffffffff : ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? rs1 : (uint32_t)((int32_t)rs1 / (int32_t)rs2); }
+static uint32_t MiniRV32IMAJitDivu( uint32_t rs1, uint32_t rs2 ) { return ( rs2 == 0 ) ? 0xffffffff : rs1 / rs2; }
+static uint32_t MiniRV32IMAJitRem( uint32_t rs1, uint32_t rs2 ) { return ( rs2 == 0 ) ? rs1 : ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? 0 : (uint32_t)((int32_t)rs1 % (int32_t)rs2); }
+static uint32_t MiniRV32IMAJitRemu( uint32_t rs1, uint32_t rs2 ) { return ( rs2 == 0 ) ? rs1 : rs1 % rs2; }
+
+static uint8_t * MiniRV32IMAJitLoadReg( uint8_t * e, int host, int reg )
+{
+	if( reg == 0 )
+	{
+		JIT_B( 0x31 ); JIT_B( 0xC0 | host << 3 | host ); // xor host, host
+	}
+	else
+	{
+		JIT_B( 0x8B ); JIT_B( 0x43 | host << 3 ); JIT_B( reg * 4 ); // mov host, [rbx+reg*4]
+	}
+	return e;
+}
+
+static uint8_t * MiniRV32IMAJitStoreReg( uint8_t * e, int host, int reg )
+{
+	JIT_B( 0x89 ); JIT_B( 0x43 | host << 3 ); JIT_B( reg * 4 ); // mov [rbx+reg*4], host
+	return e;
+}
+
+static uint8_t * MiniRV32IMAJitStoreRegImm( uint8_t * e, int reg, uint32_t imm )
+{
+	JIT_B( 0xC7 ); JIT_B( 0x43 ); JIT_B( reg * 4 ); JIT_D( imm ); // mov dword [rbx+reg*4], imm
+	return e;
+}
+
+// Leave generated code, with reason, and link as the jump to patch if the next block can be chained.
+static uint8_t * MiniRV32IMAJitExitTail( struct MiniRV32IMAJit * jit, uint8_t * e, uint32_t reason, uint8_t * link )
+{
+	if( link )
+	{
+		JIT_B( 0x48 ); JIT_B( 0x8D ); JIT_B( 0x05 ); JIT_D( link - ( e + 4 ) ); // lea rax, [rip+link]
+		JIT_B( 0x48 ); JIT_B( 0x89 ); JIT_B( 0x45 ); JIT_B( offsetof( struct MiniRV32IMAJit, link ) ); // mov [rbp+link], rax
+	}
+	else
+	{
+		JIT_B( 0x48 ); JIT_B( 0xC7 ); JIT_B( 0x45 ); JIT_B( offsetof( struct MiniRV32IMAJit, link ) ); JIT_D( 0 ); // mov qword [rbp+link], 0
+	}
+	JIT_B( 0xC7 ); JIT_B( 0x45 ); JIT_B( offsetof( struct MiniRV32IMAJit, exit_reason ) ); JIT_D( reason ); // mov dword [rbp+exit_reason], reason
+	JIT_B( 0xE9 ); JIT_D( 0 ); JIT_PATCH_REL32( e - 4, jit->exit ); // jmp exit
+	return e;
+}
+
+// Exit to a known guest PC through a jump that can later be patched straight to the next block.
+static uint8_t * MiniRV32IMAJitExitChained( struct MiniRV32IMAJit * jit, uint8_t * e, uint32_t target )
+{
+	uint8_t * link = e;
+	JIT_B( 0xE9 ); JIT_D( 0 ); // jmp +0, until chained.
+	JIT_B( 0xC7 ); JIT_B( 0x83 ); JIT_D( JIT_OFS_PC ); JIT_D( target ); // mov dword [rbx+pc], target
+	return MiniRV32IMAJitExitTail( jit, e, MINIRV32_JIT_EXIT_NEXT, link );
+}
+
+// Stop before instruction number index of a block of length count, and undo the budget and cycles taken for the rest.
+static uint8_t * MiniRV32IMAJitExitEarly( struct MiniRV32IMAJit * jit, uint8_t * e, uint32_t pc, int index, int count, uint32_t reason )
+{
+	JIT_B( 0xC7 ); JIT_B( 0x83 ); JIT_D( JIT_OFS_PC ); JIT_D( pc ); // mov dword [rbx+pc], pc
+	if( count - index )
+	{
+		JIT_B( 0x49 ); JIT_B( 0x81 ); JIT_B( 0xC5 ); JIT_D( count - index ); // add r13, n
+		JIT_B( 0x48 ); JIT_B( 0x81 ); JIT_B( 0xAB ); JIT_D( JIT_OFS_CYCLE ); JIT_D( count - index ); // sub qword [rbx+cycle], n
+	}
+	return MiniRV32IMAJitExitTail( jit, e, reason, 0 );
+}
+
+static void MiniRV32IMAJitEmitTrampoline( struct MiniRV32IMAJit * jit )
+{
+	uint8_t * e = jit->code;
+	jit->enter = (void*)e;
+	JIT_B( 0x53 );                              // push rbx
+	JIT_B( 0x55 );                              // push rbp
+	JIT_B( 0x41 ); JIT_B( 0x54 );               // push r12
+	JIT_B( 0x41 ); JIT_B( 0x55 );               // push r13
+	JIT_B( 0x41 ); JIT_B( 0x56 );               // push r14
+	JIT_B( 0x41 ); JIT_B( 0x57 );               // push r15
+	JIT_B( 0x48 ); JIT_B( 0x83 ); JIT_B( 0xEC ); JIT_B( 0x08 ); // sub rsp, 8 (keep calls 16 byte aligned)
+	JIT_B( 0x48 ); JIT_B( 0x89 ); JIT_B( 0xFB ); // mov rbx, rdi
+	JIT_B( 0x49 ); JIT_B( 0x89 ); JIT_B( 0xF4 ); // mov r12, rsi
+	JIT_B( 0x48 ); JIT_B( 0x89 ); JIT_B( 0xD5 ); // mov rbp, rdx
+	JIT_B( 0x4C ); JIT_B( 0x8B ); JIT_B( 0x6D ); JIT_B( offsetof( struct MiniRV32IMAJit, budget ) ); // mov r13, [rbp+budget]
+	JIT_B( 0x4C ); JIT_B( 0x8B ); JIT_B( 0x75 ); JIT_B( offsetof( struct MiniRV32IMAJit, code_pages ) ); // mov r14, [rbp+code_pages]
+	JIT_B( 0xFF ); JIT_B( 0xE1 );               // jmp rcx
+
+	jit->exit = e;
+	JIT_B( 0x4C ); JIT_B( 0x89 ); JIT_B( 0x6D ); JIT_B( offsetof( struct MiniRV32IMAJit, budget ) ); // mov [rbp+budget], r13
+	JIT_B( 0x48 ); JIT_B( 0x83 ); JIT_B( 0xC4 ); JIT_B( 0x08 ); // add rsp, 8
+	JIT_B( 0x41 ); JIT_B( 0x5F );               // pop r15
+	JIT_B( 0x41 ); JIT_B( 0x5E );               // pop r14
+	JIT_B( 0x41 ); JIT_B( 0x5D );               // pop r13
+	JIT_B( 0x41 ); JIT_B( 0x5C );               // pop r12
+	JIT_B( 0x5D );                              // pop rbp
+	JIT_B( 0x5B );                              // pop rbx
+	JIT_B( 0xC3 );                              // ret
+
+	jit->code_start = jit->code_used = ( e - jit->code + 15 ) & ~15;
+}
+
+MINIRV32_DECORATE void MiniRV32IMAJitFlush( struct MiniRV32IMAJit * jit )
+{
+	int i;
+	for( i = 0; i < MINIRV32_JIT_BLOCKS; i++ )
+	{
+		jit->blocks[i].pc = MINIRV32_DECODE_EMPTY;
+		jit->blocks[i].code = 0;
+	}
+	jit->code_used = jit->code_start;
+	jit->generation = jit->dcache->generation;
+	jit->flushes++;
+}
+
+MINIRV32_DECORATE struct MiniRV32IMAJit * MiniRV32IMAJitCreate( struct MiniRV32IMADecodeCache * dcache )
+{
+	struct MiniRV32IMAJit * jit = malloc( sizeof( struct MiniRV32IMAJit ) );
+	if( !jit ) return 0;
+	memset( jit, 0, sizeof( *jit ) );
+	jit->code = mmap( 0, MINIRV32_JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+	if( jit->code == MAP_FAILED )
+	{
+		free( jit );
+		return 0;
+	}
+	jit->dcache = dcache;
+	jit->code_pages = dcache->code_pages;
+	MiniRV32IMAJitEmitTrampoline( jit );
+	MiniRV32IMAJitFlush( jit );
+	return jit;
+}
+
+#ifdef MINIRV32_HOSTMEM_BASE
+// Load or store that missed RAM, with the RAM offset in eax.  Do it in the
+// host memory window if it's there, and rejoin at resume.  *side_exit gets
+// the jump to take otherwise.
+static uint8_t * MiniRV32IMAJitEmitHostMem( uint8_t * e, struct MiniRV32IMADecoded * d, uint8_t ** side_exit, uint8_t * resume )
+{
+	uint32_t funct3 = ( d->ir >> 12 ) & 7;
+	JIT_B( 0x8D ); JIT_B( 0x88 ); JIT_D( MINIRV32_RAM_IMAGE_OFFSET - MINIRV32_HOSTMEM_BASE ); // lea ecx, [rax+window delta]
+	JIT_B( 0x81 ); JIT_B( 0xF9 ); JIT_D( MINIRV32_HOSTMEM_SIZE - ( 1 << ( funct3 & 3 ) ) );     // cmp ecx, size - width
+	JIT_B( 0x0F ); JIT_B( 0x87 ); *side_exit = e; JIT_D( 0 );                                // ja side exit
+	JIT_B( 0x48 ); JIT_B( 0xBA ); JIT_Q( (uintptr_t)&MINIRV32_HOSTMEM_PTR );                  // mov rdx, &window pointer
+	JIT_B( 0x48 ); JIT_B( 0x8B ); JIT_B( 0x12 );                                             // mov rdx, [rdx]
+	if( d->op >= MINIRV32_OP_SB )
+	{
+		e = MiniRV32IMAJitLoadReg( e, JIT_EAX, d->rs2 );
+		if( d->op == MINIRV32_OP_SH ) JIT_B( 0x66 );
+		JIT_B( d->op == MINIRV32_OP_SB ? 0x88 : 0x89 ); JIT_B( 0x04 ); JIT_B( 0x0A );       // [rdx+rcx] = eax
+#ifdef MINIRV32_HOSTMEM_DIRTY
+		JIT_B( 0x48 ); JIT_B( 0xBA ); JIT_Q( (uintptr_t)&MINIRV32_HOSTMEM_DIRTY );            // mov rdx, &dirty map
+		JIT_B( 0x48 ); JIT_B( 0x8B ); JIT_B( 0x12 );                                         // mov rdx, [rdx]
+		JIT_B( 0x8D ); JIT_B( 0x41 ); JIT_B( ( 1 << ( funct3 & 3 ) ) - 1 );                  // lea eax, [rcx+width-1]
+		JIT_B( 0xC1 ); JIT_B( 0xE8 ); JIT_B( MINIRV32_HOSTMEM_DIRTY_SHIFT );                  // shr eax, shift
+		JIT_B( 0xC6 ); JIT_B( 0x04 ); JIT_B( 0x02 ); JIT_B( 0x01 );                          // mov byte [rdx+rax], 1
+		JIT_B( 0xC1 ); JIT_B( 0xE9 ); JIT_B( MINIRV32_HOSTMEM_DIRTY_SHIFT );                  // shr ecx, shift
+		JIT_B( 0xC6 ); JIT_B( 0x04 ); JIT_B( 0x0A ); JIT_B( 0x01 );                          // mov byte [rdx+rcx], 1
+#endif
+	}
+	else
+	{
+		static const uint8_t mov[][3] = { { 0x0F, 0xBE }, { 0x0F, 0xBF }, { 0x8B }, { 0x0F, 0xB6 }, { 0x0F, 0xB7 } };
+		const uint8_t * m = mov[d->op - MINIRV32_OP_LB];
+		JIT_B( m[0] ); if( m[0] == 0x0F ) JIT_B( m[1] ); JIT_B( 0x0C ); JIT_B( 0x0A );      // ecx = [rdx+rcx]
+		if( d->rd ) e = MiniRV32IMAJitStoreReg( e, JIT_ECX, d->rd );
+	}
+	JIT_B( 0xE9 ); JIT_D( 0 ); JIT_PATCH_REL32( e - 4, resume );                              // jmp resume
+	return e;
+}
+#endif
+
+static int MiniRV32IMAJitCanTranslate( uint32_t op )
+{
+	return op != MINIRV32_OP_ILLEGAL && op != MINIRV32_OP_SYSTEM && op != MINIRV32_OP_AMO;
+}
+
+// Translate the basic block at pc.  Returns 0 if its first instruction has to be interpreted.
+static uint8_t * MiniRV32IMAJitTranslate( struct MiniRV32IMAJit * jit, uint8_t * image, uint32_t pc )
+{
+	struct MiniRV32IMADecoded ops[MINIRV32_JIT_MAX_BLOCK];
+	uint8_t * fixups[MINIRV32_JIT_MAX_BLOCK][2]; // Side exit jumps per instruction.
+	uint8_t * resume[MINIRV32_JIT_MAX_BLOCK];    // Where the side path of a load or store rejoins.
+	int count = 0;
+	int i;
+
+	for( ;; )
+	{
+		uint32_t ofs = pc + count * 4 - MINIRV32_RAM_IMAGE_OFFSET;
+		if( ofs >= MINI_RV32_RAM_SIZE || ( ofs & 3 ) ) break;
+		struct MiniRV32IMADecoded * d = &ops[count];
+		MiniRV32IMADecode( d, pc + count * 4, MINIRV32_LOAD4( ofs ) );
+		if( !MiniRV32IMAJitCanTranslate( d->op ) ) break;
+		MiniRV32IMAMarkCode( jit->dcache, ofs );
+		count++;
+		if( ( d->op >= MINIRV32_OP_JAL && d->op <= MINIRV32_OP_BGEU ) || count == MINIRV32_JIT_MAX_BLOCK ) break;
+	}
+	if( count == 0 ) return 0;
+
+	if( jit->code_used + MINIRV32_JIT_BLOCK_MAX_BYTES > MINIRV32_JIT_CODE_SIZE )
+		MiniRV32IMAJitFlush( jit );
+
+	uint8_t * start = jit->code + jit->code_used;
+	uint8_t * e = start;
+	uint8_t * bail;
+
+	// Take the whole block out of the budget up front, and count its cycles.
+	JIT_B( 0x49 ); JIT_B( 0x81 ); JIT_B( 0xFD ); JIT_D( count ); // cmp r13, count
+	JIT_B( 0x0F ); JIT_B( 0x8C ); bail = e; JIT_D( 0 );          // jl bail
+	JIT_B( 0x49 ); JIT_B( 0x81 ); JIT_B( 0xED ); JIT_D( count ); // sub r13, count
+	JIT_B( 0x48 ); JIT_B( 0x81 ); JIT_B( 0x83 ); JIT_D( JIT_OFS_CYCLE ); JIT_D( count ); // add qword [rbx+cycle], count
+
+	for( i = 0; i < count; i++ )
+	{
+		struct MiniRV32IMADecoded * d = &ops[i];
+		uint32_t ipc = pc + i * 4;
+		int rd = d->rd;
+		fixups[i][0] = fixups[i][1] = 0;
+
+		switch( d->op )
+		{
+		case MINIRV32_OP_LUI:
+			if( rd ) e = MiniRV32IMAJitStoreRegImm( e, rd, d->imm );
+			break;
+		case MINIRV32_OP_JAL:
+			if( rd ) e = MiniRV32IMAJitStoreRegImm( e, rd, ipc + 4 );
+			e = MiniRV32IMAJitExitChained( jit, e, d->imm );
+			break;
+		case MINIRV32_OP_JALR:
+			e = MiniRV32IMAJitLoadReg( e, JIT_EAX, d->rs1 );
+			JIT_B( 0x05 ); JIT_D( d->imm );                 // add eax, imm
+			JIT_B( 0x83 ); JIT_B( 0xE0 ); JIT_B( 0xFE );    // and eax, ~1
+			if( rd ) e = MiniRV32IMAJitStoreRegImm( e, rd, ipc + 4 );
+			JIT_B( 0x89 ); JIT_B( 0x83 ); JIT_D( JIT_OFS_PC ); // mov [rbx+pc], eax
+			e = MiniRV32IMAJitExitTail( jit, e, MINIRV32_JIT_EXIT_NEXT, 0 );
+			break;
+		case MINIRV32_OP_BEQ: case MINIRV32_OP_BNE: case MINIRV32_OP_BLT:
+		case MINIRV32_OP_BGE: case MINIRV32_OP_BLTU: case MINIRV32_OP_BGEU:
+		{
+			static const uint8_t jcc[] = { 0x84, 0x85, 0x8C, 0x8D, 0x82, 0x83 }; // je, jne, jl, jge, jb, jae
+			uint8_t * taken;
+			e = MiniRV32IMAJitLoadReg( e, JIT_EAX, d->rs1 );
+			e = MiniRV32IMAJitLoadReg( e, JIT_ECX, d->rs2 );
+			JIT_B( 0x39 ); JIT_B( 0xC8 );                   // cmp eax, ecx
+			JIT_B( 0x0F ); JIT_B( jcc[d->op - MINIRV32_OP_BEQ] ); taken = e; JIT_D( 0 );
+			e = MiniRV32IMAJitExitChained( jit, e, ipc + 4 );
+			JIT_PATCH_REL32( taken, e );
+			e = MiniRV32IMAJitExitChained( jit, e, d->imm );
+			break;
+		}
+		case MINIRV32_OP_LB: case MINIRV32_OP_LH: case MINIRV32_OP_LW:
+		case MINIRV32_OP_LBU: case MINIRV32_OP_LHU:
+		{
+			static const uint8_t mov[][3] = { { 0x0F, 0xBE }, { 0x0F, 0xBF }, { 0x8B }, { 0x0F, 0xB6 }, { 0x0F, 0xB7 } }; // movsx b, movsx w, mov, movzx b, movzx w
+			const uint8_t * m = mov[d->op - MINIRV32_OP_LB];
+			e = MiniRV32IMAJitLoadReg( e, JIT_EAX, d->rs1 );
+			JIT_B( 0x05 ); JIT_D( d->imm - MINIRV32_RAM_IMAGE_OFFSET ); // add eax, imm - ram offset
+			JIT_B( 0x3D ); JIT_D( MINI_RV32_RAM_SIZE - 3 );              // cmp eax, ram size - 3
+			JIT_B( 0x0F ); JIT_B( 0x83 ); fixups[i][0] = e; JIT_D( 0 );  // jae side exit (MMIO, or fault)
+			JIT_B( 0x41 ); JIT_B( m[0] ); if( m[0] == 0x0F ) JIT_B( m[1] ); JIT_B( 0x0C ); JIT_B( 0x04 ); // ecx = [r12+rax]
+			if( rd ) e = MiniRV32IMAJitStoreReg( e, JIT_ECX, rd );
+			resume[i] = e;
+			break;
+		}
+		case MINIRV32_OP_SB: case MINIRV32_OP_SH: case MINIRV32_OP_SW:
+			e = MiniRV32IMAJitLoadReg( e, JIT_EAX, d->rs1 );
+			JIT_B( 0x05 ); JIT_D( d->imm - MINIRV32_RAM_IMAGE_OFFSET ); // add eax, imm - ram offset
+			JIT_B( 0x3D ); JIT_D( MINI_RV32_RAM_SIZE - 3 );              // cmp eax, ram size - 3
+			JIT_B( 0x0F ); JIT_B( 0x83 ); fixups[i][0] = e; JIT_D( 0 );  // jae side exit (MMIO, or fault)
+			JIT_B( 0x89 ); JIT_B( 0xC1 );                                // mov ecx, eax
+			JIT_B( 0xC1 ); JIT_B( 0xE9 ); JIT_B( MINIRV32_CODE_PAGE_SHIFT ); // shr ecx, page shift
+			JIT_B( 0x41 ); JIT_B( 0x80 ); JIT_B( 0x3C ); JIT_B( 0x0E ); JIT_B( 0x00 ); // cmp byte [r14+rcx], 0
+			JIT_B( 0x0F ); JIT_B( 0x85 ); fixups[i][1] = e; JIT_D( 0 );  // jne side exit (page has code on it)
+			e = MiniRV32IMAJitLoadReg( e, JIT_EDX, d->rs2 );
+			if( d->op == MINIRV32_OP_SH ) JIT_B( 0x66 );
+			JIT_B( 0x41 ); JIT_B( d->op == MINIRV32_OP_SB ? 0x88 : 0x89 ); JIT_B( 0x14 ); JIT_B( 0x04 ); // [r12+rax] = edx
+			resume[i] = e;
+			break;
+
+		case MINIRV32_OP_ADDI: case MINIRV32_OP_SLTI: case MINIRV32_OP_SLTIU: case MINIRV32_OP_XORI:
+		case MINIRV32_OP_ORI: case MINIRV32_OP_ANDI: case MINIRV32_OP_SLLI: case MINIRV32_OP_SRLI: case MINIRV32_OP_SRAI:
+			if( !rd ) break;
+			e = MiniRV32IMAJitLoadReg( e, JIT_EAX, d->rs1 );
+			switch( d->op )
+			{
+			case MINIRV32_OP_ADDI: JIT_B( 0x05 ); JIT_D( d->imm ); break; // add eax, imm
+			case MINIRV32_OP_XORI: JIT_B( 0x35 ); JIT_D( d->imm ); break; // xor eax, imm
+			case MINIRV32_OP_ORI:  JIT_B( 0x0D ); JIT_D( d->imm ); break; // or eax, imm
+			case MINIRV32_OP_ANDI: JIT_B( 0x25 ); JIT_D( d->imm ); break; // and eax, imm
+			case MINIRV32_OP_SLLI: JIT_B( 0xC1 ); JIT_B( 0xE0 ); JIT_B( d->imm ); break; // shl eax, imm
+			case MINIRV32_OP_SRLI: JIT_B( 0xC1 ); JIT_B( 0xE8 ); JIT_B( d->imm ); break; // shr eax, imm
+			case MINIRV32_OP_SRAI: JIT_B( 0xC1 ); JIT_B( 0xF8 ); JIT_B( d->imm ); break; // sar eax, imm
+			default: // SLTI, SLTIU
+				JIT_B( 0x3D ); JIT_D( d->imm );                                        // cmp eax, imm
+				JIT_B( 0x0F ); JIT_B( d->op == MINIRV32_OP_SLTI ? 0x9C : 0x92 ); JIT_B( 0xC0 ); // setl/setb al
+				JIT_B( 0x0F ); JIT_B( 0xB6 ); JIT_B( 0xC0 );                           // movzx eax, al
+				break;
+			}
+			e = MiniRV32IMAJitStoreReg( e, JIT_EAX, rd );
+			break;
+
+		case MINIRV32_OP_ADD: case MINIRV32_OP_SUB: case MINIRV32_OP_SLL: case MINIRV32_OP_SLT:
+		case MINIRV32_OP_SLTU: case MINIRV32_OP_XOR: case MINIRV32_OP_SRL: case MINIRV32_OP_SRA:
+		case MINIRV32_OP_OR: case MINIRV32_OP_AND:
+		case MINIRV32_OP_MUL: case MINIRV32_OP_MULH: case MINIRV32_OP_MULHSU: case MINIRV32_OP_MULHU:
+		case MINIRV32_OP_DIV: case MINIRV32_OP_DIVU: case MINIRV32_OP_REM: case MINIRV32_OP_REMU:
+			if( !rd ) break;
+			e = MiniRV32IMAJitLoadReg( e, JIT_EAX, d->rs1 );
+			e = MiniRV32IMAJitLoadReg( e, JIT_ECX, d->rs2 );
+			switch( d->op )
+			{
+			case MINIRV32_OP_ADD: JIT_B( 0x01 ); JIT_B( 0xC8 ); break; // add eax, ecx
+			case MINIRV32_OP_SUB: JIT_B( 0x29 ); JIT_B( 0xC8 ); break; // sub eax, ecx
+			case MINIRV32_OP_XOR: JIT_B( 0x31 ); JIT_B( 0xC8 ); break; // xor eax, ecx
+			case MINIRV32_OP_OR:  JIT_B( 0x09 ); JIT_B( 0xC8 ); break; // or eax, ecx
+			case MINIRV32_OP_AND: JIT_B( 0x21 ); JIT_B( 0xC8 ); break; // and eax, ecx
+			case MINIRV32_OP_SLL: JIT_B( 0xD3 ); JIT_B( 0xE0 ); break; // shl eax, cl (x86 masks the count to 5 bits too)
+			case MINIRV32_OP_SRL: JIT_B( 0xD3 ); JIT_B( 0xE8 ); break; // shr eax, cl
+			case MINIRV32_OP_SRA: JIT_B( 0xD3 ); JIT_B( 0xF8 ); break; // sar eax, cl
+			case MINIRV32_OP_SLT: case MINIRV32_OP_SLTU:
+				JIT_B( 0x39 ); JIT_B( 0xC8 );                                         // cmp eax, ecx
+				JIT_B( 0x0F ); JIT_B( d->op == MINIRV32_OP_SLT ? 0x9C : 0x92 ); JIT_B( 0xC0 ); // setl/setb al
+				JIT_B( 0x0F ); JIT_B( 0xB6 ); JIT_B( 0xC0 );                          // movzx eax, al
+				break;
+			case MINIRV32_OP_MUL: JIT_B( 0x0F ); JIT_B( 0xAF ); JIT_B( 0xC1 ); break; // imul eax, ecx
+			case MINIRV32_OP_MULH: case MINIRV32_OP_MULHSU: case MINIRV32_OP_MULHU:
+				// 32 bit movs zero extend, so only sign extend the signed operands, then take the high half of a 64 bit multiply.
+				if( d->op != MINIRV32_OP_MULHU ) { JIT_B( 0x48 ); JIT_B( 0x63 ); JIT_B( 0xC0 ); } // movsxd rax, eax
+				if( d->op == MINIRV32_OP_MULH ) { JIT_B( 0x48 ); JIT_B( 0x63 ); JIT_B( 0xC9 ); }  // movsxd rcx, ecx
+				JIT_B( 0x48 ); JIT_B( 0x0F ); JIT_B( 0xAF ); JIT_B( 0xC1 );  // imul rax, rcx
+				JIT_B( 0x48 ); JIT_B( 0xC1 ); JIT_B( 0xE8 ); JIT_B( 0x20 );  // shr rax, 32
+				break;
+			default: // DIV, DIVU, REM, REMU
+			{
+				static uint32_t (* const helpers[])( uint32_t, uint32_t ) = { MiniRV32IMAJitDiv, MiniRV32IMAJitDivu, MiniRV32IMAJitRem, MiniRV32IMAJitRemu };
+				JIT_B( 0x89 ); JIT_B( 0xC7 );                      // mov edi, eax
+				JIT_B( 0x89 ); JIT_B( 0xCE );                      // mov esi, ecx
+				JIT_B( 0x48 ); JIT_B( 0xB8 ); JIT_Q( (uintptr_t)helpers[d->op - MINIRV32_OP_DIV] ); // mov rax, helper
+				JIT_B( 0xFF ); JIT_B( 0xD0 );                      // call rax
+				break;
+			}
+			}
+			e = MiniRV32IMAJitStoreReg( e, JIT_EAX, rd );
+			break;
+
+		case MINIRV32_OP_FENCE:
+			break;
+		}
+	}
+
+	// Fell off the end without a jump: the block was cut short, or the next instruction needs the interpreter.
+	if( !( ops[count-1].op >= MINIRV32_OP_JAL && ops[count-1].op <= MINIRV32_OP_BGEU ) )
+		e = MiniRV32IMAJitExitChained( jit, e, pc + count * 4 );
+
+	// Out of line side exits.
+	for( i = 0; i < count; i++ )
+	{
+		if( !fixups[i][0] ) continue;
+#ifdef MINIRV32_HOSTMEM_BASE
+		JIT_PATCH_REL32( fixups[i][0], e );
+		e = MiniRV32IMAJitEmitHostMem( e, &ops[i], &fixups[i][0], resume[i] );
+#endif
+		JIT_PATCH_REL32( fixups[i][0], e );
+		if( fixups[i][1] ) JIT_PATCH_REL32( fixups[i][1], e );
+		e = MiniRV32IMAJitExitEarly( jit, e, pc + i * 4, i, count, MINIRV32_JIT_EXIT_INTERPRET );
+	}
+
+	// Not enough budget left for the whole block.  Nothing has been taken yet.
+	JIT_PATCH_REL32( bail, e );
+	e = MiniRV32IMAJitExitEarly( jit, e, pc, count, count, MINIRV32_JIT_EXIT_BUDGET );
+
+	jit->code_used = ( e - jit->code + 15 ) & ~15;
+	return start;
+}
+
+static struct MiniRV32IMAJitBlock * MiniRV32IMAJitLookup( struct MiniRV32IMAJit * jit, uint8_t * image, uint32_t pc )
+{
+	struct MiniRV32IMAJitBlock * b = &jit->blocks[ ( pc >> 2 ) & ( MINIRV32_JIT_BLOCKS - 1 ) ];
+	if( b->pc != pc )
+	{
+		b->code = MiniRV32IMAJitTranslate( jit, image, pc );
+		b->pc = pc;
+	}
+	return b;
+}
+
+MINIRV32_DECORATE int MiniRV32IMAJitTranslateAt( struct MiniRV32IMAJit * jit, uint8_t * image, uint32_t pc )
+{
+	if( jit->generation != jit->dcache->generation )
+		MiniRV32IMAJitFlush( jit );
+	return MiniRV32IMAJitLookup( jit, image, pc )->code != 0;
+}
+
+MINIRV32_DECORATE int32_t MiniRV32IMAStepJit( struct MiniRV32IMAState * state, uint8_t * image, uint32_t vProcAddress, uint32_t elapsedUs, int count, struct MiniRV32IMAJit * jit )
+{
+	// Let the interpreter advance the timer, and check WFI and interrupts
+	// without running anything.  A trap clears MIE, that's how we can tell
+	// it took one and, like the reference, is done for this slice.
+	uint32_t mie = state->mstatus & 8;
+	int32_t ret = MiniRV32IMAStepCached( state, image, vProcAddress, elapsedUs, 0, jit->dcache );
+	if( ret || ( mie && !( state->mstatus & 8 ) ) ) return ret;
+
+	int64_t budget = count;
+	uint8_t * link = 0;
+	uint32_t link_flushes = 0;
+	while( budget > 0 )
+	{
+		if( jit->generation != jit->dcache->generation )
+			MiniRV32IMAJitFlush( jit );
+
+		struct MiniRV32IMAJitBlock * b = MiniRV32IMAJitLookup( jit, image, state->pc );
+
+		// Chain the block we just left straight into this one.
+		if( link && b->code && link_flushes == jit->flushes )
+			JIT_PATCH_REL32( link + 1, b->code );
+		link = 0;
+
+		uint32_t reason = MINIRV32_JIT_EXIT_INTERPRET;
+		if( b->code )
+		{
+			jit->budget = budget;
+			jit->enter( state, image, jit, b->code );
+			budget = jit->budget;
+			reason = jit->exit_reason;
+			link = jit->link;
+			link_flushes = jit->flushes;
+		}
+
+		if( reason != MINIRV32_JIT_EXIT_NEXT )
+		{
+			// The rest of the slice, or a single instruction, through the interpreter.
+			uint64_t cycles = ( (uint64_t)state->cycleh << 32 ) | state->cyclel;
+			ret = MiniRV32IMAStepCached( state, image, vProcAddress, 0, ( reason == MINIRV32_JIT_EXIT_BUDGET ) ? budget : 1, jit->dcache );
+			if( ret ) return ret;
+			budget -= ( ( (uint64_t)state->cycleh << 32 ) | state->cyclel ) - cycles;
+		}
+	}
+	return 0;
+}
+
+#undef JIT_B
+#undef JIT_D
+#undef JIT_Q
+#undef JIT_PATCH_REL32
+#undef JIT_EAX
+#undef JIT_ECX
+#undef JIT_EDX
+#undef JIT_OFS_PC
+#undef JIT_OFS_CYCLE
+
+#endif
+
+#endif
+
+#endif
@@ -18,6 +18,16 @@
 		* There is a dedicated CLNT at 0x10000000.
 		* There is free MMIO from there to 0x12000000.
 		* You can put things like a UART, or whatever there.
+		* Define MINIRV32_HOSTMEM_BASE, MINIRV32_HOSTMEM_SIZE and
+		  MINIRV32_HOSTMEM_PTR (a uint8_t * lvalue) to back one window of
+		  the physical address space with plain host memory, i.e. a
+		  framebuffer.  Loads and stores there keep their width and never
+		  reach the control hooks.  If MINIRV32_HOSTMEM_DIRTY (also a
+		  uint8_t * lvalue) is defined too, stores set the byte for every
+		  1<<MINIRV32_HOSTMEM_DIRTY_SHIFT bytes of the window they touch.
+		* Define MINIRV32_EXTERNAL_INTERRUPT as an expression that is nonzero
+		  while a device wants attention.  It's sampled at the start of every
+		  step, drives MEIP (mip bit 11) and wakes the hart from WFI.
 		* Feel free to override any of the functionality with macros.
 */
 
@@ -106,6 +116,102 @@ struct MiniRV32IMAState
 MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint8_t * image, uint32_t vProcAddress, uint32_t elapsedUs, int count );
 #endif
 
+#ifdef MINIRV32_HOSTMEM_BASE
+MINIRV32_DECORATE int MiniRV32IMAHostMemLoad( uint32_t addy, uint32_t funct3, uint32_t * rval );
+MINIRV32_DECORATE int MiniRV32IMAHostMemStore( uint32_t addy, uint32_t funct3, uint32_t val );
+#endif
+
+#if defined( MINIRV32_THREADED_DISPATCH ) && !defined( MINIRV32_DECODE_CACHE )
+	#define MINIRV32_DECODE_CACHE
+#endif
+
+#ifdef MINIRV32_DECODE_CACHE
+
+/**
+	Optional predecoded instruction cache.  MiniRV32IMAStep stays the
+	reference implementation, MiniRV32IMAStepCached runs the same machine
+	off of pre-decoded micro-ops, keyed by guest PC.
+
+	The host owns the cache, and must provide one byte per RAM page in
+	code_pages and one bit per RAM word in code_words.  Call
+	MiniRV32IMAFlushDecodeCache before first use and any time it writes to
+	guest RAM itself (i.e. loading an image).
+
+	MiniRV32IMAInstallDecoded puts back entries saved from an earlier run
+	of the same image, so the host can keep them across restarts without
+	decoding them again.
+
+	Reserved load/store widths decode as illegal instructions, the
+	reference only notices them after the address check.
+
+	Define MINIRV32_THREADED_DISPATCH to build MiniRV32IMAStepCached as
+	threaded code instead of a switch: one handler per micro-op, each
+	ending in its own indirect jump to the next handler.  This needs GCC
+	labels-as-values.
+*/
+
+#if defined( MINIRV32_THREADED_DISPATCH ) && !defined( __GNUC__ )
+	#error MINIRV32_THREADED_DISPATCH needs labels-as-values (GCC or clang)
+#endif
+
+#ifndef MINIRV32_DECODE_CACHE_BITS
+	#define MINIRV32_DECODE_CACHE_BITS 16
+#endif
+
+#define MINIRV32_DECODE_CACHE_ENTRIES (1<<MINIRV32_DECODE_CACHE_BITS)
+#define MINIRV32_DECODE_CACHE_MASK (MINIRV32_DECODE_CACHE_ENTRIES-1)
+#define MINIRV32_DECODE_EMPTY 1 // Never a valid (aligned) PC.
+#define MINIRV32_CODE_PAGE_SHIFT 12
+
+// Fully resolved instruction forms.  AUIPC is folded into LUI, since the
+// entry is only valid for the PC it was decoded at.
+enum MiniRV32IMAOp
+{
+	MINIRV32_OP_ILLEGAL = 0,
+	MINIRV32_OP_LUI, MINIRV32_OP_JAL, MINIRV32_OP_JALR,
+	MINIRV32_OP_BEQ, MINIRV32_OP_BNE, MINIRV32_OP_BLT, MINIRV32_OP_BGE, MINIRV32_OP_BLTU, MINIRV32_OP_BGEU,
+	MINIRV32_OP_LB, MINIRV32_OP_LH, MINIRV32_OP_LW, MINIRV32_OP_LBU, MINIRV32_OP_LHU,
+	MINIRV32_OP_SB, MINIRV32_OP_SH, MINIRV32_OP_SW,
+	MINIRV32_OP_ADDI, MINIRV32_OP_SLTI, MINIRV32_OP_SLTIU, MINIRV32_OP_XORI, MINIRV32_OP_ORI, MINIRV32_OP_ANDI,
+	MINIRV32_OP_SLLI, MINIRV32_OP_SRLI, MINIRV32_OP_SRAI,
+	MINIRV32_OP_ADD, MINIRV32_OP_SUB, MINIRV32_OP_SLL, MINIRV32_OP_SLT, MINIRV32_OP_SLTU,
+	MINIRV32_OP_XOR, MINIRV32_OP_SRL, MINIRV32_OP_SRA, MINIRV32_OP_OR, MINIRV32_OP_AND,
+	MINIRV32_OP_MUL, MINIRV32_OP_MULH, MINIRV32_OP_MULHSU, MINIRV32_OP_MULHU,
+	MINIRV32_OP_DIV, MINIRV32_OP_DIVU, MINIRV32_OP_REM, MINIRV32_OP_REMU,
+	MINIRV32_OP_FENCE,
+	MINIRV32_OP_SYSTEM, // Zicsr, ECALL, EBREAK, MRET, WFI: decoded from ir at execution time.
+	MINIRV32_OP_AMO,    // RV32A: decoded from ir at execution time.
+	MINIRV32_OP_COUNT,
+};
+
+struct MiniRV32IMADecoded
+{
+	uint32_t pc;  // Tag, the guest PC this was decoded from.
+	uint32_t ir;  // Raw instruction, for MINIRV32_POSTEXEC and the slow paths.
+	int32_t imm;  // Sign extended immediate, or absolute target for JAL/branches.
+	uint8_t op;
+	uint8_t rd;
+	uint8_t rs1;
+	uint8_t rs2;
+};
+
+struct MiniRV32IMADecodeCache
+{
+	uint32_t generation;  // Bumped any time decoded code is overwritten or flushed.
+	uint8_t * code_pages; // MINI_RV32_RAM_SIZE >> MINIRV32_CODE_PAGE_SHIFT bytes, nonzero if any code was decoded from that page.
+	uint8_t * code_words; // MINI_RV32_RAM_SIZE >> 5 bytes, one bit per word that was decoded.
+	struct MiniRV32IMADecoded entries[MINIRV32_DECODE_CACHE_ENTRIES];
+};
+
+MINIRV32_DECORATE void MiniRV32IMADecode( struct MiniRV32IMADecoded * d, uint32_t pc, uint32_t ir );
+MINIRV32_DECORATE void MiniRV32IMAFlushDecodeCache( struct MiniRV32IMADecodeCache * dcache );
+MINIRV32_DECORATE void MiniRV32IMAMarkCode( struct MiniRV32IMADecodeCache * dcache, uint32_t ofs );
+MINIRV32_DECORATE void MiniRV32IMAInvalidateCode( struct MiniRV32IMADecodeCache * dcache, uint32_t ofs );
+MINIRV32_DECORATE int MiniRV32IMAInstallDecoded( struct MiniRV32IMADecodeCache * dcache, uint8_t * image, const struct MiniRV32IMADecoded * d );
+MINIRV32_DECORATE int32_t MiniRV32IMAStepCached( struct MiniRV32IMAState * state, uint8_t * image, uint32_t vProcAddress, uint32_t elapsedUs, int count, struct MiniRV32IMADecodeCache * dcache );
+
+#endif
+
 #ifdef MINIRV32_IMPLEMENTATION
 
 #ifndef MINIRV32_CUSTOM_INTERNALS
@@ -115,6 +221,48 @@ MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint
 #define REGSET( x, val ) { state->regs[x] = val; }
 #endif
 
+#ifdef MINIRV32_HOSTMEM_BASE
+// Loads and stores to the host memory window.  addy is a physical address,
+// funct3 the load/store width.  Returns 0 if the access isn't entirely
+// inside the window.
+MINIRV32_DECORATE int MiniRV32IMAHostMemLoad( uint32_t addy, uint32_t funct3, uint32_t * rval )
+{
+	uint32_t ofs = addy - MINIRV32_HOSTMEM_BASE;
+	if( ofs >= MINIRV32_HOSTMEM_SIZE || ofs > MINIRV32_HOSTMEM_SIZE - ( 1 << ( funct3 & 3 ) ) ) return 0;
+	uint8_t * p = MINIRV32_HOSTMEM_PTR + ofs;
+	switch( funct3 )
+	{
+		case 0: *rval = *(int8_t*)p; break;
+		case 1: *rval = *(int16_t*)p; break;
+		case 2: *rval = *(uint32_t*)p; break;
+		case 4: *rval = *(uint8_t*)p; break;
+		case 5: *rval = *(uint16_t*)p; break;
+		default: return 0;
+	}
+	return 1;
+}
+
+MINIRV32_DECORATE int MiniRV32IMAHostMemStore( uint32_t addy, uint32_t funct3, uint32_t val )
+{
+	uint32_t ofs = addy - MINIRV32_HOSTMEM_BASE;
+	uint32_t width = 1 << ( funct3 & 3 );
+	if( ofs >= MINIRV32_HOSTMEM_SIZE || ofs > MINIRV32_HOSTMEM_SIZE - width ) return 0;
+	uint8_t * p = MINIRV32_HOSTMEM_PTR + ofs;
+	switch( funct3 )
+	{
+		case 0: *(uint8_t*)p = val; break;
+		case 1: *(uint16_t*)p = val; break;
+		case 2: *(uint32_t*)p = val; break;
+		default: return 0;
+	}
+#ifdef MINIRV32_HOSTMEM_DIRTY
+	MINIRV32_HOSTMEM_DIRTY[ ofs >> MINIRV32_HOSTMEM_DIRTY_SHIFT ] = 1;
+	MINIRV32_HOSTMEM_DIRTY[ ( ofs + width - 1 ) >> MINIRV32_HOSTMEM_DIRTY_SHIFT ] = 1;
+#endif
+	return 1;
+}
+#endif
+
 #ifndef MINIRV32_STEPPROTO
 MINIRV32_DECORATE int32_t MiniRV32IMAStep( struct MiniRV32IMAState * state, uint8_t * image, uint32_t vProcAddress, uint32_t elapsedUs, int count )
 #else
@@ -134,6 +282,17 @@ MINIRV32_STEPPROTO
 	else
 		CSR( mip ) &= ~(1<<7);
 
+#ifdef MINIRV32_EXTERNAL_INTERRUPT
+	// Machine external interrupt, level triggered, the host decides.
+	if( MINIRV32_EXTERNAL_INTERRUPT )
+	{
+		CSR( extraflags ) &= ~4; // Clear WFI
+		CSR( mip ) |= 1<<11; //MEIP of MIP
+	}
+	else
+		CSR( mip ) &= ~(1<<11);
+#endif
+
 	// If WFI, don't run processor.
 	if( CSR( extraflags ) & 4 )
 		return 1;
@@ -143,13 +302,13 @@ MINIRV32_STEPPROTO
 	uint32_t pc = CSR( pc );
 	uint32_t cycle = CSR( cyclel );
 
-	if( ( CSR( mip ) & (1<<7) ) && ( CSR( mie ) & (1<<7) /*mtie*/ ) && ( CSR( mstatus ) & 0x8 /*mie*/) )
+	if( ( CSR( mip ) & CSR( mie ) & ( (1<<11) /*meie*/ | (1<<7) /*mtie*/ ) ) && ( CSR( mstatus ) & 0x8 /*mie*/) )
 	{
-		// Timer interrupt.
-		trap = 0x80000007;
+		// External or timer interrupt, external first.
+		trap = ( CSR( mip ) & CSR( mie ) & (1<<11) ) ? 0x8000000b : 0x80000007;
 		pc -= 4;
 	}
-	else // No timer interrupt?  Execute a bunch of instructions.
+	else // No interrupt?  Execute a bunch of instructions.
 	for( int icount = 0; icount < count; icount++ )
 	{
 		uint32_t ir = 0;
@@ -228,6 +387,13 @@ MINIRV32_STEPPROTO
 					if( rsval >= MINI_RV32_RAM_SIZE-3 )
 					{
 						rsval += MINIRV32_RAM_IMAGE_OFFSET;
+#ifdef MINIRV32_HOSTMEM_BASE
+						if( MiniRV32IMAHostMemLoad( rsval, ( ir >> 12 ) & 0x7, &rval ) )
+						{
+							// Plain host memory.
+						}
+						else
+#endif
 						if( MINIRV32_MMIO_RANGE( rsval ) )  // UART, CLNT
 						{
 							MINIRV32_HANDLE_MEM_LOAD_CONTROL( rsval, rval );
@@ -265,6 +431,13 @@ MINIRV32_STEPPROTO
 					if( addy >= MINI_RV32_RAM_SIZE-3 )
 					{
 						addy += MINIRV32_RAM_IMAGE_OFFSET;
+#ifdef MINIRV32_HOSTMEM_BASE
+						if( MiniRV32IMAHostMemStore( addy, ( ir >> 12 ) & 0x7, rs2 ) )
+						{
+							// Plain host memory.
+						}
+						else
+#endif
 						if( MINIRV32_MMIO_RANGE( addy ) )
 						{
 							MINIRV32_HANDLE_MEM_STORE_CONTROL( addy, rs2 );
@@ -535,6 +708,611 @@ MINIRV32_STEPPROTO
 	return 0;
 }
 
+#ifdef MINIRV32_DECODE_CACHE
+
+MINIRV32_DECORATE void MiniRV32IMADecode( struct MiniRV32IMADecoded * d, uint32_t pc, uint32_t ir )
+{
+	uint32_t funct3 = ( ir >> 12 ) & 0x7;
+	uint32_t imm = ir >> 20;
+	int32_t imm_se = imm | (( imm & 0x800 )?0xfffff000:0);
+	uint32_t op = MINIRV32_OP_ILLEGAL;
+
+	d->pc = pc;
+	d->ir = ir;
+	d->rd = (ir >> 7) & 0x1f;
+	d->rs1 = (ir >> 15) & 0x1f;
+	d->rs2 = (ir >> 20) & 0x1f;
+	d->imm = imm_se;
+
+	switch( ir & 0x7f )
+	{
+		case 0x37: // LUI
+			op = MINIRV32_OP_LUI;
+			d->imm = ir & 0xfffff000;
+			break;
+		case 0x17: // AUIPC
+			op = MINIRV32_OP_LUI;
+			d->imm = pc + ( ir & 0xfffff000 );
+			break;
+		case 0x6F: // JAL
+		{
+			int32_t reladdy = ((ir & 0x80000000)>>11) | ((ir & 0x7fe00000)>>20) | ((ir & 0x00100000)>>9) | ((ir&0x000ff000));
+			if( reladdy & 0x00100000 ) reladdy |= 0xffe00000; // Sign extension.
+			op = MINIRV32_OP_JAL;
+			d->imm = pc + reladdy;
+			break;
+		}
+		case 0x67: // JALR
+			op = MINIRV32_OP_JALR;
+			break;
+		case 0x63: // Branch
+		{
+			uint32_t immm4 = ((ir & 0xf00)>>7) | ((ir & 0x7e000000)>>20) | ((ir & 0x80) << 4) | ((ir >> 31)<<12);
+			if( immm4 & 0x1000 ) immm4 |= 0xffffe000;
+			d->imm = pc + immm4;
+			d->rd = 0;
+			switch( funct3 )
+			{
+				case 0: op = MINIRV32_OP_BEQ; break;
+				case 1: op = MINIRV32_OP_BNE; break;
+				case 4: op = MINIRV32_OP_BLT; break;
+				case 5: op = MINIRV32_OP_BGE; break;
+				case 6: op = MINIRV32_OP_BLTU; break;
+				case 7: op = MINIRV32_OP_BGEU; break;
+			}
+			break;
+		}
+		case 0x03: // Load
+			switch( funct3 )
+			{
+				case 0: op = MINIRV32_OP_LB; break;
+				case 1: op = MINIRV32_OP_LH; break;
+				case 2: op = MINIRV32_OP_LW; break;
+				case 4: op = MINIRV32_OP_LBU; break;
+				case 5: op = MINIRV32_OP_LHU; break;
+			}
+			break;
+		case 0x23: // Store
+		{
+			uint32_t addy = ( ( ir >> 7 ) & 0x1f ) | ( ( ir & 0xfe000000 ) >> 20 );
+			if( addy & 0x800 ) addy |= 0xfffff000;
+			d->imm = addy;
+			d->rd = 0;
+			switch( funct3 )
+			{
+				case 0: op = MINIRV32_OP_SB; break;
+				case 1: op = MINIRV32_OP_SH; break;
+				case 2: op = MINIRV32_OP_SW; break;
+			}
+			break;
+		}
+		case 0x13: // Op-immediate
+			switch( funct3 )
+			{
+				case 0: op = MINIRV32_OP_ADDI; break;
+				case 1: op = MINIRV32_OP_SLLI; d->imm = imm & 0x1f; break;
+				case 2: op = MINIRV32_OP_SLTI; break;
+				case 3: op = MINIRV32_OP_SLTIU; break;
+				case 4: op = MINIRV32_OP_XORI; break;
+				case 5: op = ( ir & 0x40000000 ) ? MINIRV32_OP_SRAI : MINIRV32_OP_SRLI; d->imm = imm & 0x1f; break;
+				case 6: op = MINIRV32_OP_ORI; break;
+				case 7: op = MINIRV32_OP_ANDI; break;
+			}
+			break;
+		case 0x33: // Op
+			if( ir & 0x02000000 ) // RV32M
+				op = MINIRV32_OP_MUL + funct3;
+			else switch( funct3 )
+			{
+				case 0: op = ( ir & 0x40000000 ) ? MINIRV32_OP_SUB : MINIRV32_OP_ADD; break;
+				case 1: op = MINIRV32_OP_SLL; break;
+				case 2: op = MINIRV32_OP_SLT; break;
+				case 3: op = MINIRV32_OP_SLTU; break;
+				case 4: op = MINIRV32_OP_XOR; break;
+				case 5: op = ( ir & 0x40000000 ) ? MINIRV32_OP_SRA : MINIRV32_OP_SRL; break;
+				case 6: op = MINIRV32_OP_OR; break;
+				case 7: op = MINIRV32_OP_AND; break;
+			}
+			break;
+		case 0x0f: // Fence
+			op = MINIRV32_OP_FENCE;
+			d->rd = 0;
+			break;
+		case 0x73: op = MINIRV32_OP_SYSTEM; break;
+		case 0x2f: op = MINIRV32_OP_AMO; break;
+	}
+	d->op = op;
+}
+
+MINIRV32_DECORATE void MiniRV32IMAFlushDecodeCache( struct MiniRV32IMADecodeCache * dcache )
+{
+	int i;
+	for( i = 0; i < MINIRV32_DECODE_CACHE_ENTRIES; i++ )
+		dcache->entries[i].pc = MINIRV32_DECODE_EMPTY;
+	memset( dcache->code_pages, 0, MINI_RV32_RAM_SIZE >> MINIRV32_CODE_PAGE_SHIFT );
+	memset( dcache->code_words, 0, MINI_RV32_RAM_SIZE >> 5 );
+	dcache->generation++;
+}
+
+// Record that the instruction word at RAM offset ofs has been decoded.
+MINIRV32_DECORATE void MiniRV32IMAMarkCode( struct MiniRV32IMADecodeCache * dcache, uint32_t ofs )
+{
+	dcache->code_pages[ ofs >> MINIRV32_CODE_PAGE_SHIFT ] = 1;
+	dcache->code_words[ ofs >> 5 ] |= 1 << ( ( ofs >> 2 ) & 7 );
+}
+
+// Called for stores landing on a page that has decoded code on it.  ofs is the RAM offset.
+MINIRV32_DECORATE void MiniRV32IMAInvalidateCode( struct MiniRV32IMADecodeCache * dcache, uint32_t ofs )
+{
+	// Misaligned stores can straddle two instruction words.
+	uint32_t w;
+	for( w = ofs & ~3; w <= ofs + 3 && w < MINI_RV32_RAM_SIZE; w += 4 )
+	{
+		if( !( dcache->code_words[ w >> 5 ] & ( 1 << ( ( w >> 2 ) & 7 ) ) ) ) continue;
+		struct MiniRV32IMADecoded * d = &dcache->entries[ ( w >> 2 ) & MINIRV32_DECODE_CACHE_MASK ];
+		if( d->pc == w + MINIRV32_RAM_IMAGE_OFFSET ) d->pc = MINIRV32_DECODE_EMPTY;
+		dcache->generation++;
+	}
+}
+
+// Put back an entry saved from dcache->entries, if image still holds the same instruction at d->pc.
+// It's installed as it is, not decoded again, so the host has to know it
+// came from this decoder (i.e. check a checksum over what it saved).  The
+// op and register numbers are still range checked, they index tables and
+// state->regs.  Returns nonzero if it was installed.
+MINIRV32_DECORATE int MiniRV32IMAInstallDecoded( struct MiniRV32IMADecodeCache * dcache, uint8_t * image, const struct MiniRV32IMADecoded * d )
+{
+	uint32_t ofs = d->pc - MINIRV32_RAM_IMAGE_OFFSET;
+	if( ofs >= MINI_RV32_RAM_SIZE - 3 || ( ofs & 3 ) || d->op >= MINIRV32_OP_COUNT || ( d->rd | d->rs1 | d->rs2 ) > 31 ) return 0;
+	if( MINIRV32_LOAD4( ofs ) != d->ir ) return 0;
+	dcache->entries[ ( ofs >> 2 ) & MINIRV32_DECODE_CACHE_MASK ] = *d;
+	MiniRV32IMAMarkCode( dcache, ofs );
+	return 1;
+}
+
+#ifdef MINIRV32_HOSTMEM_BASE
+	#define MINIRV32_CACHED_HOSTMEM_LOAD( addy, rval ) if( MiniRV32IMAHostMemLoad( addy, ( d->ir >> 12 ) & 0x7, &rval ) ) { } else
+	#define MINIRV32_CACHED_HOSTMEM_STORE( addy, val ) if( MiniRV32IMAHostMemStore( addy, ( d->ir >> 12 ) & 0x7, val ) ) { } else
+#else
+	#define MINIRV32_CACHED_HOSTMEM_LOAD( addy, rval )
+	#define MINIRV32_CACHED_HOSTMEM_STORE( addy, val )
+#endif
+
+#define MINIRV32_CACHED_LOAD( loadop ) \
+	{ \
+		uint32_t rsval = REG( d->rs1 ) + d->imm - MINIRV32_RAM_IMAGE_OFFSET; \
+		if( rsval >= MINI_RV32_RAM_SIZE-3 ) \
+		{ \
+			rsval += MINIRV32_RAM_IMAGE_OFFSET; \
+			MINIRV32_CACHED_HOSTMEM_LOAD( rsval, rval ) \
+			if( MINIRV32_MMIO_RANGE( rsval ) ) \
+			{ \
+				MINIRV32_HANDLE_MEM_LOAD_CONTROL( rsval, rval ); \
+			} \
+			else \
+			{ \
+				trap = (5+1); \
+				rval = rsval; \
+			} \
+		} \
+		else \
+			rval = loadop( rsval ); \
+	}
+
+#define MINIRV32_CACHED_STORE( storeop ) \
+	{ \
+		uint32_t rs2 = REG( d->rs2 ); \
+		uint32_t addy = REG( d->rs1 ) + d->imm - MINIRV32_RAM_IMAGE_OFFSET; \
+		if( addy >= MINI_RV32_RAM_SIZE-3 ) \
+		{ \
+			addy += MINIRV32_RAM_IMAGE_OFFSET; \
+			MINIRV32_CACHED_HOSTMEM_STORE( addy, rs2 ) \
+			if( MINIRV32_MMIO_RANGE( addy ) ) \
+			{ \
+				MINIRV32_HANDLE_MEM_STORE_CONTROL( addy, rs2 ); \
+			} \
+			else \
+			{ \
+				trap = (7+1); \
+				rval = addy; \
+			} \
+		} \
+		else \
+		{ \
+			if( dcache->code_pages[ addy >> MINIRV32_CODE_PAGE_SHIFT ] ) MiniRV32IMAInvalidateCode( dcache, addy ); \
+			storeop( addy, rs2 ); \
+		} \
+	}
+
+// Fetch the micro-op at pc, decoding it on a miss.
+#define MINIRV32_CACHED_FETCH \
+	if( icount >= count ) goto cached_end; \
+	icount++; \
+	rval = 0; \
+	cycle++; \
+	{ \
+		uint32_t ofs_pc = pc - MINIRV32_RAM_IMAGE_OFFSET; \
+		if( ofs_pc >= MINI_RV32_RAM_SIZE ) \
+		{ \
+			trap = 1 + 1;  /* Handle access violation on instruction read. */ \
+			goto cached_end; \
+		} \
+		else if( ofs_pc & 3 ) \
+		{ \
+			trap = 1 + 0;  /* Handle PC-misaligned access */ \
+			goto cached_end; \
+		} \
+		d = &dcache->entries[ ( ofs_pc >> 2 ) & MINIRV32_DECODE_CACHE_MASK ]; \
+		if( d->pc != pc ) \
+		{ \
+			MiniRV32IMADecode( d, pc, MINIRV32_LOAD4( ofs_pc ) ); \
+			MiniRV32IMAMarkCode( dcache, ofs_pc ); \
+		} \
+	} \
+	ir = d->ir; \
+	rdid = d->rd;
+
+// If there was a trap, do NOT allow register writeback.
+#define MINIRV32_CACHED_RETIRE \
+	if( trap ) \
+	{ \
+		SETCSR( pc, pc ); \
+		MINIRV32_POSTEXEC( pc, ir, trap ); \
+		goto cached_end; \
+	} \
+	if( rdid ) \
+	{ \
+		REGSET( rdid, rval ); \
+	} \
+	MINIRV32_POSTEXEC( pc, ir, trap ); \
+	pc += 4;
+
+#ifdef MINIRV32_THREADED_DISPATCH
+	// Every handler retires its instruction and dispatches the next one itself.
+	#define MINIRV32_HANDLER( op ) op_##op:
+	#define MINIRV32_NEXT MINIRV32_CACHED_RETIRE MINIRV32_CACHED_FETCH goto *dispatch[ d->op ];
+	#define MINIRV32_LABEL( op ) [MINIRV32_OP_##op] = &&op_##op
+#else
+	#define MINIRV32_HANDLER( op ) case MINIRV32_OP_##op:
+	#define MINIRV32_NEXT break;
+#endif
+
+#if defined( MINIRV32_THREADED_DISPATCH ) && !defined( __clang__ )
+// Otherwise GCC merges the per-handler dispatch tails back into a single indirect jump.
+__attribute__((optimize("no-gcse","no-crossjumping")))
+#endif
+MINIRV32_DECORATE int32_t MiniRV32IMAStepCached( struct MiniRV32IMAState * state, uint8_t * image, uint32_t vProcAddress, uint32_t elapsedUs, int count, struct MiniRV32IMADecodeCache * dcache )
+{
+#ifdef MINIRV32_THREADED_DISPATCH
+	static const void * const dispatch[MINIRV32_OP_COUNT] = {
+		MINIRV32_LABEL( ILLEGAL ),
+		MINIRV32_LABEL( LUI ), MINIRV32_LABEL( JAL ), MINIRV32_LABEL( JALR ),
+		MINIRV32_LABEL( BEQ ), MINIRV32_LABEL( BNE ), MINIRV32_LABEL( BLT ), MINIRV32_LABEL( BGE ), MINIRV32_LABEL( BLTU ), MINIRV32_LABEL( BGEU ),
+		MINIRV32_LABEL( LB ), MINIRV32_LABEL( LH ), MINIRV32_LABEL( LW ), MINIRV32_LABEL( LBU ), MINIRV32_LABEL( LHU ),
+		MINIRV32_LABEL( SB ), MINIRV32_LABEL( SH ), MINIRV32_LABEL( SW ),
+		MINIRV32_LABEL( ADDI ), MINIRV32_LABEL( SLTI ), MINIRV32_LABEL( SLTIU ), MINIRV32_LABEL( XORI ), MINIRV32_LABEL( ORI ), MINIRV32_LABEL( ANDI ),
+		MINIRV32_LABEL( SLLI ), MINIRV32_LABEL( SRLI ), MINIRV32_LABEL( SRAI ),
+		MINIRV32_LABEL( ADD ), MINIRV32_LABEL( SUB ), MINIRV32_LABEL( SLL ), MINIRV32_LABEL( SLT ), MINIRV32_LABEL( SLTU ),
+		MINIRV32_LABEL( XOR ), MINIRV32_LABEL( SRL ), MINIRV32_LABEL( SRA ), MINIRV32_LABEL( OR ), MINIRV32_LABEL( AND ),
+		MINIRV32_LABEL( MUL ), MINIRV32_LABEL( MULH ), MINIRV32_LABEL( MULHSU ), MINIRV32_LABEL( MULHU ),
+		MINIRV32_LABEL( DIV ), MINIRV32_LABEL( DIVU ), MINIRV32_LABEL( REM ), MINIRV32_LABEL( REMU ),
+		MINIRV32_LABEL( FENCE ),
+		MINIRV32_LABEL( SYSTEM ),
+		MINIRV32_LABEL( AMO ),
+	};
+#endif
+	uint32_t new_timer = CSR( timerl ) + elapsedUs;
+	if( new_timer < CSR( timerl ) ) CSR( timerh )++;
+	CSR( timerl ) = new_timer;
+
+	// Handle Timer interrupt.
+	if( ( CSR( timerh ) > CSR( timermatchh ) || ( CSR( timerh ) == CSR( timermatchh ) && CSR( timerl ) > CSR( timermatchl ) ) ) && ( CSR( timermatchh ) || CSR( timermatchl ) ) )
+	{
+		CSR( extraflags ) &= ~4; // Clear WFI
+		CSR( mip ) |= 1<<7; //MTIP of MIP
+	}
+	else
+		CSR( mip ) &= ~(1<<7);
+
+#ifdef MINIRV32_EXTERNAL_INTERRUPT
+	// Machine external interrupt, level triggered, the host decides.
+	if( MINIRV32_EXTERNAL_INTERRUPT )
+	{
+		CSR( extraflags ) &= ~4; // Clear WFI
+		CSR( mip ) |= 1<<11; //MEIP of MIP
+	}
+	else
+		CSR( mip ) &= ~(1<<11);
+#endif
+
+	// If WFI, don't run processor.
+	if( CSR( extraflags ) & 4 )
+		return 1;
+
+	uint32_t trap = 0;
+	uint32_t rval = 0;
+	uint32_t pc = CSR( pc );
+	uint32_t cycle = CSR( cyclel );
+	uint32_t ir = 0;
+	uint32_t rdid = 0;
+	int icount = 0;
+	struct MiniRV32IMADecoded * d;
+
+	if( ( CSR( mip ) & CSR( mie ) & ( (1<<11) /*meie*/ | (1<<7) /*mtie*/ ) ) && ( CSR( mstatus ) & 0x8 /*mie*/) )
+	{
+		// External or timer interrupt, external first.
+		trap = ( CSR( mip ) & CSR( mie ) & (1<<11) ) ? 0x8000000b : 0x80000007;
+		pc -= 4;
+		goto cached_end;
+	}
+
+	// No interrupt?  Execute a bunch of instructions.
+#ifdef MINIRV32_THREADED_DISPATCH
+	MINIRV32_CACHED_FETCH
+	goto *dispatch[ d->op ];
+#else
+	for( ;; )
+	{
+		MINIRV32_CACHED_FETCH
+		switch( d->op )
+		{
+#endif
+			MINIRV32_HANDLER( LUI ) rval = d->imm; MINIRV32_NEXT
+			MINIRV32_HANDLER( JAL ) rval = pc + 4; pc = d->imm - 4; MINIRV32_NEXT
+			MINIRV32_HANDLER( JALR ) rval = pc + 4; pc = ( ( REG( d->rs1 ) + d->imm ) & ~1 ) - 4; MINIRV32_NEXT
+
+			MINIRV32_HANDLER( BEQ ) if( REG( d->rs1 ) == REG( d->rs2 ) ) pc = d->imm - 4; MINIRV32_NEXT
+			MINIRV32_HANDLER( BNE ) if( REG( d->rs1 ) != REG( d->rs2 ) ) pc = d->imm - 4; MINIRV32_NEXT
+			MINIRV32_HANDLER( BLT ) if( (int32_t)REG( d->rs1 ) < (int32_t)REG( d->rs2 ) ) pc = d->imm - 4; MINIRV32_NEXT
+			MINIRV32_HANDLER( BGE ) if( (int32_t)REG( d->rs1 ) >= (int32_t)REG( d->rs2 ) ) pc = d->imm - 4; MINIRV32_NEXT
+			MINIRV32_HANDLER( BLTU ) if( REG( d->rs1 ) < REG( d->rs2 ) ) pc = d->imm - 4; MINIRV32_NEXT
+			MINIRV32_HANDLER( BGEU ) if( REG( d->rs1 ) >= REG( d->rs2 ) ) pc = d->imm - 4; MINIRV32_NEXT
+
+			MINIRV32_HANDLER( LB ) MINIRV32_CACHED_LOAD( MINIRV32_LOAD1_SIGNED ); MINIRV32_NEXT
+			MINIRV32_HANDLER( LH ) MINIRV32_CACHED_LOAD( MINIRV32_LOAD2_SIGNED ); MINIRV32_NEXT
+			MINIRV32_HANDLER( LW ) MINIRV32_CACHED_LOAD( MINIRV32_LOAD4 ); MINIRV32_NEXT
+			MINIRV32_HANDLER( LBU ) MINIRV32_CACHED_LOAD( MINIRV32_LOAD1 ); MINIRV32_NEXT
+			MINIRV32_HANDLER( LHU ) MINIRV32_CACHED_LOAD( MINIRV32_LOAD2 ); MINIRV32_NEXT
+
+			MINIRV32_HANDLER( SB ) MINIRV32_CACHED_STORE( MINIRV32_STORE1 ); MINIRV32_NEXT
+			MINIRV32_HANDLER( SH ) MINIRV32_CACHED_STORE( MINIRV32_STORE2 ); MINIRV32_NEXT
+			MINIRV32_HANDLER( SW ) MINIRV32_CACHED_STORE( MINIRV32_STORE4 ); MINIRV32_NEXT
+
+			MINIRV32_HANDLER( ADDI ) rval = REG( d->rs1 ) + d->imm; MINIRV32_NEXT
+			MINIRV32_HANDLER( SLTI ) rval = (int32_t)REG( d->rs1 ) < d->imm; MINIRV32_NEXT
+			MINIRV32_HANDLER( SLTIU ) rval = REG( d->rs1 ) < (uint32_t)d->imm; MINIRV32_NEXT
+			MINIRV32_HANDLER( XORI ) rval = REG( d->rs1 ) ^ d->imm; MINIRV32_NEXT
+			MINIRV32_HANDLER( ORI ) rval = REG( d->rs1 ) | d->imm; MINIRV32_NEXT
+			MINIRV32_HANDLER( ANDI ) rval = REG( d->rs1 ) & d->imm; MINIRV32_NEXT
+			MINIRV32_HANDLER( SLLI ) rval = REG( d->rs1 ) << d->imm; MINIRV32_NEXT
+			MINIRV32_HANDLER( SRLI ) rval = REG( d->rs1 ) >> d->imm; MINIRV32_NEXT
+			MINIRV32_HANDLER( SRAI ) rval = (int32_t)REG( d->rs1 ) >> d->imm; MINIRV32_NEXT
+
+			MINIRV32_HANDLER( ADD ) rval = REG( d->rs1 ) + REG( d->rs2 ); MINIRV32_NEXT
+			MINIRV32_HANDLER( SUB ) rval = REG( d->rs1 ) - REG( d->rs2 ); MINIRV32_NEXT
+			MINIRV32_HANDLER( SLL ) rval = REG( d->rs1 ) << ( REG( d->rs2 ) & 0x1F ); MINIRV32_NEXT
+			MINIRV32_HANDLER( SLT ) rval = (int32_t)REG( d->rs1 ) < (int32_t)REG( d->rs2 ); MINIRV32_NEXT
+			MINIRV32_HANDLER( SLTU ) rval = REG( d->rs1 ) < REG( d->rs2 ); MINIRV32_NEXT
+			MINIRV32_HANDLER( XOR ) rval = REG( d->rs1 ) ^ REG( d->rs2 ); MINIRV32_NEXT
+			MINIRV32_HANDLER( SRL ) rval = REG( d->rs1 ) >> ( REG( d->rs2 ) & 0x1F ); MINIRV32_NEXT
+			MINIRV32_HANDLER( SRA ) rval = (int32_t)REG( d->rs1 ) >> ( REG( d->rs2 ) & 0x1F ); MINIRV32_NEXT
+			MINIRV32_HANDLER( OR ) rval = REG( d->rs1 ) | REG( d->rs2 ); MINIRV32_NEXT
+			MINIRV32_HANDLER( AND ) rval = REG( d->rs1 ) & REG( d->rs2 ); MINIRV32_NEXT
+
+			MINIRV32_HANDLER( MUL ) rval = REG( d->rs1 ) * REG( d->rs2 ); MINIRV32_NEXT
+			MINIRV32_HANDLER( MULH ) rval = ((int64_t)((int32_t)REG( d->rs1 )) * (int64_t)((int32_t)REG( d->rs2 ))) >> 32; MINIRV32_NEXT
+			MINIRV32_HANDLER( MULHSU ) rval = ((int64_t)((int32_t)REG( d->rs1 )) * (uint64_t)REG( d->rs2 )) >> 32; MINIRV32_NEXT
+			MINIRV32_HANDLER( MULHU ) rval = ((uint64_t)REG( d->rs1 ) * (uint64_t)REG( d->rs2 )) >> 32; MINIRV32_NEXT
+			MINIRV32_HANDLER( DIV )
+			{
+				uint32_t rs1 = REG( d->rs1 ), rs2 = REG( d->rs2 );
+				if( rs2 == 0 ) rval = -1; else rval = ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? rs1 : ((int32_t)rs1 / (int32_t)rs2);
+			}
+			MINIRV32_NEXT
+			MINIRV32_HANDLER( DIVU )
+			{
+				uint32_t rs1 = REG( d->rs1 ), rs2 = REG( d->rs2 );
+				if( rs2 == 0 ) rval = 0xffffffff; else rval = rs1 / rs2;
+			}
+			MINIRV32_NEXT
+			MINIRV32_HANDLER( REM )
+			{
+				uint32_t rs1 = REG( d->rs1 ), rs2 = REG( d->rs2 );
+				if( rs2 == 0 ) rval = rs1; else rval = ((int32_t)rs1 == INT32_MIN && (int32_t)rs2 == -1) ? 0 : ((uint32_t)((int32_t)rs1 % (int32_t)rs2));
+			}
+			MINIRV32_NEXT
+			MINIRV32_HANDLER( REMU )
+			{
+				uint32_t rs1 = REG( d->rs1 ), rs2 = REG( d->rs2 );
+				if( rs2 == 0 ) rval = rs1; else rval = rs1 % rs2;
+			}
+			MINIRV32_NEXT
+
+			MINIRV32_HANDLER( FENCE ) MINIRV32_NEXT
+
+			MINIRV32_HANDLER( SYSTEM ) // Rare, so this is the reference implementation verbatim.
+			{
+				uint32_t csrno = ir >> 20;
+				uint32_t microop = ( ir >> 12 ) & 0x7;
+				if( (microop & 3) ) // It's a Zicsr function.
+				{
+					int rs1imm = (ir >> 15) & 0x1f;
+					uint32_t rs1 = REG(rs1imm);
+					uint32_t writeval = rs1;
+
+					switch( csrno )
+					{
+					case 0x340: rval = CSR( mscratch ); break;
+					case 0x305: rval = CSR( mtvec ); break;
+					case 0x304: rval = CSR( mie ); break;
+					case 0xC00: rval = cycle; break;
+					case 0x344: rval = CSR( mip ); break;
+					case 0x341: rval = CSR( mepc ); break;
+					case 0x300: rval = CSR( mstatus ); break; //mstatus
+					case 0x342: rval = CSR( mcause ); break;
+					case 0x343: rval = CSR( mtval ); break;
+					case 0xf11: rval = 0xff0ff0ff; break; //mvendorid
+					case 0x301: rval = 0x40401101; break; //misa (XLEN=32, IMA+X)
+					default:
+						MINIRV32_OTHERCSR_READ( csrno, rval );
+						break;
+					}
+
+					switch( microop )
+					{
+						case 1: writeval = rs1; break;  			//CSRRW
+						case 2: writeval = rval | rs1; break;		//CSRRS
+						case 3: writeval = rval & ~rs1; break;		//CSRRC
+						case 5: writeval = rs1imm; break;			//CSRRWI
+						case 6: writeval = rval | rs1imm; break;	//CSRRSI
+						case 7: writeval = rval & ~rs1imm; break;	//CSRRCI
+					}
+
+					switch( csrno )
+					{
+					case 0x340: SETCSR( mscratch, writeval ); break;
+					case 0x305: SETCSR( mtvec, writeval ); break;
+					case 0x304: SETCSR( mie, writeval ); break;
+					case 0x344: SETCSR( mip, writeval ); break;
+					case 0x341: SETCSR( mepc, writeval ); break;
+					case 0x300: SETCSR( mstatus, writeval ); break; //mstatus
+					case 0x342: SETCSR( mcause, writeval ); break;
+					case 0x343: SETCSR( mtval, writeval ); break;
+					default:
+						MINIRV32_OTHERCSR_WRITE( csrno, writeval );
+						break;
+					}
+				}
+				else if( microop == 0x0 ) // "SYSTEM" 0b000
+				{
+					rdid = 0;
+					if( ( ( csrno & 0xff ) == 0x02 ) )  // MRET
+					{
+						uint32_t startmstatus = CSR( mstatus );
+						uint32_t startextraflags = CSR( extraflags );
+						SETCSR( mstatus , (( startmstatus & 0x80) >> 4) | ((startextraflags&3) << 11) | 0x80 );
+						SETCSR( extraflags, (startextraflags & ~3) | ((startmstatus >> 11) & 3) );
+						pc = CSR( mepc ) -4;
+					} else {
+						switch (csrno) {
+						case 0:
+							trap = ( CSR( extraflags ) & 3) ? (11+1) : (8+1); // ECALL; 8 = "Environment call from U-mode"; 11 = "Environment call from M-mode"
+							break;
+						case 1:
+							trap = (3+1); break; // EBREAK 3 = "Breakpoint"
+						case 0x105: //WFI (Wait for interrupts)
+							CSR( mstatus ) |= 8;    //Enable interrupts
+							CSR( extraflags ) |= 4; //Infor environment we want to go to sleep.
+							SETCSR( pc, pc + 4 );
+							return 1;
+						default:
+							trap = (2+1); break; // Illegal opcode.
+						}
+					}
+				}
+				else
+					trap = (2+1); 				// Note micrrop 0b100 == undefined.
+			}
+			MINIRV32_NEXT
+			MINIRV32_HANDLER( AMO )
+			{
+				uint32_t rs1 = REG( d->rs1 );
+				uint32_t rs2 = REG( d->rs2 );
+				uint32_t irmid = ( ir>>27 ) & 0x1f;
+
+				rs1 -= MINIRV32_RAM_IMAGE_OFFSET;
+
+				if( rs1 >= MINI_RV32_RAM_SIZE-3 )
+				{
+					trap = (7+1); //Store/AMO access fault
+					rval = rs1 + MINIRV32_RAM_IMAGE_OFFSET;
+				}
+				else
+				{
+					rval = MINIRV32_LOAD4( rs1 );
+
+					uint32_t dowrite = 1;
+					switch( irmid )
+					{
+						case 2: //LR.W (0b00010)
+							dowrite = 0;
+							CSR( extraflags ) = (CSR( extraflags ) & 0x07) | (rs1<<3);
+							break;
+						case 3:  //SC.W (0b00011) (Make sure we have a slot, and, it's valid)
+							rval = ( CSR( extraflags ) >> 3 != ( rs1 & 0x1fffffff ) );  // Validate that our reservation slot is OK.
+							dowrite = !rval; // Only write if slot is valid.
+							break;
+						case 1: break; //AMOSWAP.W (0b00001)
+						case 0: rs2 += rval; break; //AMOADD.W (0b00000)
+						case 4: rs2 ^= rval; break; //AMOXOR.W (0b00100)
+						case 12: rs2 &= rval; break; //AMOAND.W (0b01100)
+						case 8: rs2 |= rval; break; //AMOOR.W (0b01000)
+						case 16: rs2 = ((int32_t)rs2<(int32_t)rval)?rs2:rval; break; //AMOMIN.W (0b10000)
+						case 20: rs2 = ((int32_t)rs2>(int32_t)rval)?rs2:rval; break; //AMOMAX.W (0b10100)
+						case 24: rs2 = (rs2<rval)?rs2:rval; break; //AMOMINU.W (0b11000)
+						case 28: rs2 = (rs2>rval)?rs2:rval; break; //AMOMAXU.W (0b11100)
+						default: trap = (2+1); dowrite = 0; break; //Not supported.
+					}
+					if( dowrite )
+					{
+						if( dcache->code_pages[ rs1 >> MINIRV32_CODE_PAGE_SHIFT ] ) MiniRV32IMAInvalidateCode( dcache, rs1 );
+						MINIRV32_STORE4( rs1, rs2 );
+					}
+				}
+			}
+			MINIRV32_NEXT
+			MINIRV32_HANDLER( ILLEGAL ) trap = (2+1); MINIRV32_NEXT // Fault: Invalid opcode.
+#ifndef MINIRV32_THREADED_DISPATCH
+			default: trap = (2+1); break;
+		}
+		MINIRV32_CACHED_RETIRE
+	}
+#endif
+
+cached_end:
+	// Handle traps and interrupts.
+	if( trap )
+	{
+		if( trap & 0x80000000 ) // If prefixed with 1 in MSB, it's an interrupt, not a trap.
+		{
+			SETCSR( mcause, trap );
+			SETCSR( mtval, 0 );
+			pc += 4; // PC needs to point to where the PC will return to.
+		}
+		else
+		{
+			SETCSR( mcause,  trap - 1 );
+			SETCSR( mtval, (trap > 5 && trap <= 8)? rval : pc );
+		}
+		SETCSR( mepc, pc ); //TRICKY: The kernel advances mepc automatically.
+		SETCSR( mstatus, (( CSR( mstatus ) & 0x08) << 4) | (( CSR( extraflags ) & 3 ) << 11) );
+		pc = (CSR( mtvec ) - 4);
+
+		// If trapping, always enter machine mode.
+		CSR( extraflags ) |= 3;
+
+		trap = 0;
+		pc += 4;
+	}
+
+	if( CSR( cyclel ) > cycle ) CSR( cycleh )++;
+	SETCSR( cyclel, cycle );
+	SETCSR( pc, pc );
+	return 0;
+}
+
+#undef MINIRV32_CACHED_FETCH
+#undef MINIRV32_CACHED_RETIRE
+#undef MINIRV32_HANDLER
+#undef MINIRV32_NEXT
+#undef MINIRV32_LABEL
+#undef MINIRV32_CACHED_LOAD
+#undef MINIRV32_CACHED_STORE
+#undef MINIRV32_CACHED_HOSTMEM_LOAD
+#undef MINIRV32_CACHED_HOSTMEM_STORE
+
+#endif
+
 #endif
 
 #endif